@@ -0,0 +1,49 @@
+// lfsd-bench: lfsd's own overhead on synthetic trees of 1k/10k/100k packages.
+// Usage: lfsd-bench [--dir DIR] [--keep] [N...]   (default: 1000 10000 100000)
+// Each row shows the timings of the hot paths; compare them across commits to find regressions.
+#define main lfsd_main
+#include "../lfsd.cpp"
+#undef main
+
+static double timed(const function<void()> &fn){ auto t0 = chrono::steady_clock::now(); fn(); return secs_since(t0); }
+
+// recipes/<cat>/<name>/recipe.toml with up to 3 deps on earlier packages (acyclic), deterministic
+static vector<string> gen_recipes(const string &root, int n, mt19937 &rng){ vector<string> paths; paths.reserve(n);
+    for(int i=0;i<n;i++){ string name = "pkg"+to_string(i), dir = joinp(root, "cat"+to_string(i%64)+"/"+name); ensure_dir(dir);
+        string deps; int nd = i ? min<int>(i, rng()%4) : 0; set<int> ds; while((int)ds.size()<nd) ds.insert(rng()%i); for(int d: ds) deps += string(deps.empty()?"":", ")+"\"pkg"+to_string(d)+"\"";
+        string t = "name = \""+name+"\"\nversion = \"1."+to_string(i%10)+"\"\ndepends = ["+deps+"]\n"
+            "sources = [\"https://example.org/"+name+"-1.0.tar.xz\"]\nsha256 = \""+string(64, 'a')+"\"\n"
+            "configure = [\"./configure --prefix=/usr\"]\nmake = [\"make -j${JOBS}\"]\ninstall = [\"make DESTDIR=${STAGE} install\"]\n";
+        paths.push_back(joinp(dir, "recipe.toml")); dump(paths.back(), t); }
+    return paths; }
+
+static unordered_map<string, InstalledInfo> gen_installed(int n, int files_per_pkg){ unordered_map<string, InstalledInfo> db; db.reserve(n);
+    for(int i=0;i<n;i++){ InstalledInfo info; string name = "pkg"+to_string(i); info.version = "1."+to_string(i%10); info.installed_at = "20260101-000000";
+        info.manifest = "/var/lib/lfsd/manifests/"+name+"-"+info.version+".manifest"; info.source_hash = string(64, 'b');
+        for(int f=0;f<files_per_pkg;f++) info.files.push_back("/usr/lib/"+name+"/file"+to_string(f)+".so"); db[name] = move(info); }
+    return db; }
+
+// staged tree of `n` 4 KiB files spread over directories
+static void gen_stage(const string &root, int n){ string blob(4096, 'x'); for(int i=0;i<n;i++){ string d = joinp(root, "usr/share/d"+to_string(i/256)); if(i%256==0) ensure_dir(d); blob[0] = 'a'+i%26; dump(joinp(d, "f"+to_string(i)), blob); } }
+
+int main(int argc, char **argv){ string base = "/tmp/lfsd-bench"; bool keep=false; vector<int> sizes;
+    for(int i=1;i<argc;i++){ string a = argv[i]; if(a=="--dir" && i+1<argc) base = argv[++i]; else if(a=="--keep") keep=true; else sizes.push_back(atoi(a.c_str())); }
+    if(sizes.empty()) sizes = {1000, 10000, 100000};
+    ansi::init("never"); Config c; c.jobs = thread::hardware_concurrency(); c.trace_format = "off";
+    printf("%8s %13s %16s %10s %12s %11s %12s %12s %10s %10s\n", "pkgs", "find_recipes", "load_recipe_toml", "topo_sort", "index_cold", "index_warm", "save_inst", "load_inst", "manifest", "pack");
+    for(int n: sizes){ string dir = joinp(base, to_string(n)); error_code ec; filesystem::remove_all(dir, ec); mt19937 rng(42);
+        c.recipes_dir = joinp(dir, "recipes"); c.state_dir = joinp(dir, "state"); ensure_dir(c.recipes_dir); ensure_dir(c.state_dir);
+        auto paths = gen_recipes(c.recipes_dir, n, rng);
+        unordered_map<string,string> found; double t_find = timed([&]{ found = find_recipes(c.recipes_dir); });
+        unordered_map<string, vector<string>> deps; double t_parse = timed([&]{ for(auto &p: paths){ Recipe r = load_recipe_toml(p); deps[r.name] = r.depends; } });
+        vector<string> order; double t_topo = timed([&]{ order = topo_sort(deps); });
+        double t_idx_cold = timed([&]{ recipe_index_ptr(c, true); }), t_idx_warm = timed([&]{ recipe_index_ptr(c, true); });
+        auto db = gen_installed(n, 20); double t_save = timed([&]{ save_installed(c, db); });
+        size_t loaded=0; double t_load = timed([&]{ loaded = load_installed(c).size(); });
+        string stage = joinp(dir, "stage"); gen_stage(stage, max(1, n/10)); vector<ManifestEntry> mani;
+        double t_mani = timed([&]{ package_stage(stage, "", false, c.jobs, mani, "bench"); }); mani.clear();
+        double t_pack = timed([&]{ package_stage(stage, joinp(dir, "bench.tar.zst"), false, c.jobs, mani, "bench"); });
+        if(found.size()!=(size_t)n || order.size()!=(size_t)n || loaded!=(size_t)n || mani.size()!=(size_t)max(1, n/10)){ fprintf(stderr, "bench %d: unexpected results (%zu recipes, %zu ordered, %zu installed, %zu manifest entries)\n", n, found.size(), order.size(), loaded, mani.size()); return 1; }
+        printf("%8d %12.3fs %15.3fs %9.3fs %11.3fs %10.3fs %11.3fs %11.3fs %9.3fs %9.3fs\n", n, t_find, t_parse, t_topo, t_idx_cold, t_idx_warm, t_save, t_load, t_mani, t_pack); fflush(stdout);
+        if(!keep) filesystem::remove_all(dir, ec); }
+    return 0; }
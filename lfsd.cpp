@@ -2,9 +2,21 @@
 // Requer: C++17, glibc
 
 #include <bits/stdc++.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <linux/fs.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -24,11 +36,24 @@ namespace ansi {
 }
 
 // ----------------- helpers -----------------
-static int run(const string &cmd){ cerr<<"$ "<<cmd<<"\n"; return system(cmd.c_str()); }
+static mutex io_mu; // parallel builds write to cerr at the same time
+static void errln(const string &s){ lock_guard<mutex> g(io_mu); cerr<<s<<"\n"; }
+static int run(const string &cmd){ errln("$ "+cmd); return system(cmd.c_str()); }
 static string nowstamp(){ time_t t=time(nullptr); char buf[64]; strftime(buf,sizeof(buf),"%Y%m%d-%H%M%S",localtime(&t)); return string(buf); }
-static void ensure_dir(const string &p){ string cmd = "mkdir -p '"+p+"'"; run(cmd); }
+static void ensure_dir(const string &p){ error_code ec; filesystem::create_directories(p, ec); }
 static bool exists_file(const string &p){ struct stat st; return stat(p.c_str(), &st)==0; }
 static string joinp(const string &a, const string &b){ if(a.empty()) return b; if(a.back()=='/') return a+b; return a+"/"+b; }
+static double secs_since(chrono::steady_clock::time_point t0){ return chrono::duration<double>(chrono::steady_clock::now()-t0).count(); }
+
+// per-package phase timings (download, unpack, patch, configure, make, tests, install, strip, manifest, pack, apply);
+// written to log_dir/trace at the end of each command, as plain JSON or Chrome trace (trace_format)
+namespace trace {
+struct Event { string pkg, phase; double start, dur; };
+static mutex mu; static vector<Event> events; static chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+static void add(const string &pkg, const string &phase, double start, double dur){ lock_guard<mutex> g(mu); events.push_back({pkg, phase, start, dur}); }
+struct Span { string pkg, phase; double start; Span(string p, string ph): pkg(move(p)), phase(move(ph)), start(secs_since(t0)) {} ~Span(){ add(pkg, phase, start, secs_since(t0)-start); } };
+static void reset(){ lock_guard<mutex> g(mu); events.clear(); t0 = chrono::steady_clock::now(); }
+}
 
 // read whole file
 static string slurp(const string &p){ ifstream f(p); if(!f) return string(); stringstream ss; ss<<f.rdbuf(); return ss.str(); }
@@ -36,11 +61,90 @@ static string slurp(const string &p){ ifstream f(p); if(!f) return string(); str
 // write file
 static void dump(const string &p, const string &content){ ofstream f(p); f<<content; }
 
+// crash-safe write: unique tmp file in the same directory (concurrent writers never share it) + fsync + rename + fsync of the directory
+static bool dump_atomic(const string &p, const string &content){ string tmp = p+".XXXXXX"; int fd = mkostemp(&tmp[0], O_CLOEXEC); if(fd<0) return false;
+    if(fchmod(fd, 0644)!=0){ close(fd); unlink(tmp.c_str()); return false; }
+    size_t off=0; while(off<content.size()){ ssize_t n = write(fd, content.data()+off, content.size()-off); if(n<0){ if(errno==EINTR) continue; close(fd); unlink(tmp.c_str()); return false; } off+=n; }
+    if(fsync(fd)!=0 || close(fd)!=0 || rename(tmp.c_str(), p.c_str())!=0){ unlink(tmp.c_str()); return false; }
+    int dfd = open(filesystem::path(p).parent_path().c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC); if(dfd>=0){ fsync(dfd); close(dfd); } return true; }
+
+// exclusive flock on p (created if missing), released on destruction
+struct FileLock { int fd=-1; explicit FileLock(const string &p){ fd = open(p.c_str(), O_CREAT|O_RDWR|O_CLOEXEC, 0644); if(fd>=0) while(flock(fd, LOCK_EX)!=0 && errno==EINTR){} } ~FileLock(){ if(fd>=0) close(fd); } FileLock(const FileLock&)=delete; FileLock &operator=(const FileLock&)=delete; };
+
 // run and capture output
 static string caprun(const string &cmd){ array<char,256> buf; string out; FILE* f = popen(cmd.c_str(),"r"); if(!f) return out; while(fgets(buf.data(), buf.size(), f)) out += buf.data(); pclose(f); return out; }
 
-// sha256 file via sha256sum
-static string sha256_file(const string &p){ if(!exists_file(p)) return string(); string out = caprun("sha256sum '"+p+"'"); smatch m; regex re("^([a-fA-F0-9]{64})"); if(regex_search(out,m,re)) return m[1]; return string(); }
+// run fn(i) for i in [0,n) on up to `threads` workers
+static void parallel_for(size_t n, int threads, const function<void(size_t)> &fn){ threads = (int)min<size_t>(max(1,threads), n); if(threads<=1){ for(size_t i=0;i<n;i++) fn(i); return; }
+    atomic<size_t> next{0}; vector<thread> ts; for(int t=0;t<threads;t++) ts.emplace_back([&]{ for(size_t i; (i=next++)<n;) fn(i); }); for(auto &t: ts) t.join(); }
+
+// ----------------- sha256 (in-process, SHA-NI when available) -----------------
+namespace sha256 {
+    static const uint32_t K[64] = {
+        0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+        0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+        0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+        0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2 };
+    static inline uint32_t ror(uint32_t x, int n){ return (x>>n)|(x<<(32-n)); }
+
+    static void blocks_generic(uint32_t *h, const uint8_t *p, size_t nblk){
+        for(; nblk--; p+=64){ uint32_t w[64];
+            for(int i=0;i<16;i++) w[i] = (uint32_t)p[4*i]<<24 | (uint32_t)p[4*i+1]<<16 | (uint32_t)p[4*i+2]<<8 | (uint32_t)p[4*i+3];
+            for(int i=16;i<64;i++){ uint32_t s0 = ror(w[i-15],7)^ror(w[i-15],18)^(w[i-15]>>3), s1 = ror(w[i-2],17)^ror(w[i-2],19)^(w[i-2]>>10); w[i] = w[i-16]+s0+w[i-7]+s1; }
+            uint32_t a=h[0], b=h[1], c=h[2], d=h[3], e=h[4], f=h[5], g=h[6], hh=h[7];
+            for(int i=0;i<64;i++){ uint32_t t1 = hh + (ror(e,6)^ror(e,11)^ror(e,25)) + ((e&f)^(~e&g)) + K[i] + w[i]; uint32_t t2 = (ror(a,2)^ror(a,13)^ror(a,22)) + ((a&b)^(a&c)^(b&c)); hh=g; g=f; f=e; e=d+t1; d=c; c=b; b=a; a=t1+t2; }
+            h[0]+=a; h[1]+=b; h[2]+=c; h[3]+=d; h[4]+=e; h[5]+=f; h[6]+=g; h[7]+=hh; }
+    }
+
+#if defined(__x86_64__)
+    // Intel SHA extensions: 4 rounds per rnds2 pair, message schedule via msg1/msg2
+    __attribute__((target("sha,sse4.1"))) static void blocks_shani(uint32_t *h, const uint8_t *p, size_t nblk){
+        const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[0]), 0xB1); // CDAB
+        __m128i st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[4]), 0x1B); // EFGH
+        __m128i st0 = _mm_alignr_epi8(tmp, st1, 8); // ABEF
+        st1 = _mm_blend_epi16(st1, tmp, 0xF0); // CDGH
+        for(; nblk--; p+=64){ __m128i abef = st0, cdgh = st1, m[4], msg;
+            for(int g=0; g<16; g++){
+                if(g<4) m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p+16*g)), MASK);
+                msg = _mm_add_epi32(m[g&3], _mm_loadu_si128((const __m128i*)&K[4*g]));
+                st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+                if(g>=3 && g<=14){ __m128i t = _mm_alignr_epi8(m[g&3], m[(g+3)&3], 4); m[(g+1)&3] = _mm_sha256msg2_epu32(_mm_add_epi32(m[(g+1)&3], t), m[g&3]); }
+                st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(msg, 0x0E));
+                if(g>=1 && g<=12) m[(g+3)&3] = _mm_sha256msg1_epu32(m[(g+3)&3], m[g&3]);
+            }
+            st0 = _mm_add_epi32(st0, abef); st1 = _mm_add_epi32(st1, cdgh); }
+        tmp = _mm_shuffle_epi32(st0, 0x1B); // FEBA
+        st1 = _mm_shuffle_epi32(st1, 0xB1); // DCHG
+        _mm_storeu_si128((__m128i*)&h[0], _mm_blend_epi16(tmp, st1, 0xF0)); // DCBA
+        _mm_storeu_si128((__m128i*)&h[4], _mm_alignr_epi8(st1, tmp, 8)); // HGFE
+    }
+    static bool has_shani(){ unsigned a,b,c,d; if(!__get_cpuid(1,&a,&b,&c,&d) || !(c&bit_SSE4_1)) return false; return __get_cpuid_count(7,0,&a,&b,&c,&d) && (b&(1u<<29)); }
+#endif
+
+    static void (*const blocks)(uint32_t*, const uint8_t*, size_t) =
+#if defined(__x86_64__)
+        has_shani() ? blocks_shani :
+#endif
+        blocks_generic;
+
+    struct Ctx { uint32_t h[8] = {0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19}; uint64_t len=0; uint8_t buf[64]; size_t n=0; };
+    static void update(Ctx &x, const void *data, size_t len){ auto p = (const uint8_t*)data; x.len += len;
+        if(x.n){ size_t k = min(len, 64-x.n); memcpy(x.buf+x.n, p, k); x.n+=k; p+=k; len-=k; if(x.n<64) return; blocks(x.h, x.buf, 1); x.n=0; }
+        if(len>=64){ blocks(x.h, p, len/64); p += len&~(size_t)63; len &= 63; }
+        memcpy(x.buf, p, len); x.n=len; }
+    static string final_hex(Ctx &x){ uint64_t bits = x.len*8; uint8_t pad[72]={0x80}; size_t padn = (x.n<56?56:120)-x.n; for(int i=0;i<8;i++) pad[padn+i] = (uint8_t)(bits>>(56-8*i)); uint64_t len=x.len; update(x, pad, padn+8); x.len=len;
+        static const char *hex="0123456789abcdef"; string out(64,'0'); for(int i=0;i<32;i++){ uint8_t v = (uint8_t)(x.h[i/4]>>(24-8*(i%4))); out[2*i]=hex[v>>4]; out[2*i+1]=hex[v&15]; } return out; }
+}
+
+// sha256 of a file: mmap for big files, large buffered reads otherwise ("" if unreadable)
+static string sha256_file(const string &p){ int fd = open(p.c_str(), O_RDONLY|O_CLOEXEC); if(fd<0) return string(); struct stat st; sha256::Ctx x; bool ok = fstat(fd,&st)==0;
+    if(ok && S_ISREG(st.st_mode) && st.st_size >= (1<<20)){ void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0); if(m!=MAP_FAILED){ madvise(m, st.st_size, MADV_SEQUENTIAL); sha256::update(x, m, st.st_size); munmap(m, st.st_size); close(fd); return sha256::final_hex(x); } }
+    static thread_local vector<char> buf(1<<18); ssize_t n; while(ok && (n=read(fd, buf.data(), buf.size()))!=0){ if(n<0){ if(errno==EINTR) continue; ok=false; break; } sha256::update(x, buf.data(), n); }
+    close(fd); return ok?sha256::final_hex(x):string(); }
+
+// hash many files on a thread pool; result[i] matches files[i]
+static vector<string> sha256_files(const vector<string> &files, int threads){ vector<string> out(files.size()); parallel_for(files.size(), threads, [&](size_t i){ out[i] = sha256_file(files[i]); }); return out; }
 
 // ----------------- config -----------------
 struct Config {
@@ -53,9 +157,16 @@ struct Config {
     string log_dir = "/var/log/lfsd";
     string remote_url = "";
     string channel = "stable";
-    string snapshot_backend = "tar"; // default tar.zst
+    string snapshot_backend = "cas"; // cas (deduplicated, snaps/objects) or tar (full tar.zst)
+    int snapshot_keep = 7; // snapshots kept by `lfsd snapshot gc`
+    int txn_keep = 10; // finished transactions (and their backups) kept for rollback; older ones are pruned after each apply
     string color = "auto";
     int jobs = 0;
+    int max_builds = 0; // concurrent builds in the scheduler; 0 = jobs/4
+    string cache_max_size = "20G"; // size cap of the build cache in bin_dir (lfsd cache gc)
+    int fetch_jobs = 4; // concurrent downloads in prefetch
+    string trace_format = "json"; // log_dir/trace/<date>-<cmd>.json: json, chrome (chrome://tracing, Perfetto) or off
+    string socket_path = "/run/lfsd.sock"; // socket of `lfsd daemon`; without a daemon the CLI runs commands itself
 };
 
 static Config load_config(){ Config c; // env overrides
@@ -69,12 +180,22 @@ static Config load_config(){ Config c; // env overrides
     if(const char* v = getenv("LFSD_REMOTE_URL")) c.remote_url=v;
     if(const char* v = getenv("LFSD_CHANNEL")) c.channel=v;
     if(const char* v = getenv("LFSD_SNAPSHOT_BACKEND")) c.snapshot_backend=v;
+    if(const char* v = getenv("LFSD_SNAPSHOT_KEEP")) c.snapshot_keep = max(0, atoi(v));
+    if(const char* v = getenv("LFSD_TXN_KEEP")) c.txn_keep = max(0, atoi(v));
     if(const char* v = getenv("LFSD_COLOR")) c.color=v;
     if(const char* v = getenv("LFSD_JOBS")) c.jobs = atoi(v);
+    if(const char* v = getenv("LFSD_MAX_BUILDS")) c.max_builds = atoi(v);
+    if(const char* v = getenv("LFSD_CACHE_MAX_SIZE")) c.cache_max_size = v;
+    if(const char* v = getenv("LFSD_SOCKET")) c.socket_path = v;
+    if(const char* v = getenv("LFSD_TRACE_FORMAT")) c.trace_format = v;
+    if(const char* v = getenv("LFSD_FETCH_JOBS")) c.fetch_jobs = max(1, atoi(v));
     if(c.jobs<=0) c.jobs = thread::hardware_concurrency();
-    ensure_dir(c.recipes_dir); ensure_dir(c.state_dir); ensure_dir(c.stage_dir); ensure_dir(c.cache_dir); ensure_dir(c.sources_dir); ensure_dir(c.bin_dir); ensure_dir(c.log_dir);
+    if(c.max_builds<=0) c.max_builds = max(1, c.jobs/4);
     return c; }
 
+// created by dispatch, except for read-only commands (lfsd-early runs `verify` early in boot and must not create anything)
+static void prepare_dirs(const Config &c){ ensure_dir(c.recipes_dir); ensure_dir(c.state_dir); ensure_dir(c.stage_dir); ensure_dir(c.cache_dir); ensure_dir(c.sources_dir); ensure_dir(c.bin_dir); ensure_dir(c.log_dir); }
+
 // ----------------- recipe parsing (minimal TOML-like)
 struct Recipe {
     string name, version;
@@ -93,7 +214,7 @@ static string trim(const string &s){ size_t a=0,b=s.size(); while(a<b && isspace
 static vector<string> parse_array_line(const string &line){ vector<string> out; // expects ["a","b"]
     size_t l = line.find('['); size_t r = line.rfind(']'); if(l==string::npos||r==string::npos||r<=l) return out;
     string mid = line.substr(l+1, r-l-1);
-    regex re(R"("([^"]+)")"); smatch m; string s = mid; auto it = s.cbegin(); while(regex_search(it, s.cend(), m, re)){ out.push_back(m[1]); it = m.suffix().first; }
+    regex re(R"re("([^"]+)")re"); smatch m; string s = mid; auto it = s.cbegin(); while(regex_search(it, s.cend(), m, re)){ out.push_back(m[1]); it = m.suffix().first; }
     return out;
 }
 
@@ -110,7 +231,7 @@ static Recipe load_recipe_toml(const string &path){ Recipe r; r.path = path; str
         else if(line.rfind("depends",0)==0){ r.depends = parse_array_line(line); }
         else if(line.rfind("bin_only",0)==0){ auto p=line.find('='); string v=trim(line.substr(p+1)); r.bin_only = (v=="true"||v=="True"); }
         else if(line.rfind("configure",0)==0){ r.configure = parse_array_line(line); }
-        else if(line.rfind("make",0)==0 && line.find("make \")==string::npos){ r.make_cmd = parse_array_line(line); }
+        else if(line.rfind("make",0)==0){ r.make_cmd = parse_array_line(line); }
         else if(line.rfind("install",0)==0){ r.install_cmd = parse_array_line(line); }
         else if(line.rfind("tests",0)==0){ r.tests = parse_array_line(line); }
     }
@@ -120,23 +241,158 @@ static Recipe load_recipe_toml(const string &path){ Recipe r; r.path = path; str
 // find recipes recursively
 static unordered_map<string,string> find_recipes(const string &root){ unordered_map<string,string> out; for(auto &it: filesystem::recursive_directory_iterator(root)){ if(it.path().filename()=="recipe.toml"){ Recipe r = load_recipe_toml(it.path()); if(!r.name.empty()) out[r.name]=it.path(); } } return out; }
 
-// ----------------- state management (installed.json minimal)
+// ----------------- recipe index (state_dir/recipes.idx) ----------------
+// Keeps the parsed fields of each recipe.toml with its mtime/size, and the mtime of each directory.
+// If nothing changed, one stat per entry is enough; otherwise the tree is listed again and only the changed files are reparsed.
+struct RecipeIndex { unordered_map<string, Recipe> recipes; unordered_map<string, vector<string>> rdeps; };
+
+namespace ridx {
+    struct FileEnt { long long mtime=0, size=0; Recipe r; };
+    struct Data { map<string,long long> dirs; map<string,FileEnt> files; };
+    static const char *HEADER = "lfsd-recipes 1";
+    static long long mtime_ns(const struct stat &st){ return (long long)st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec; }
+    static string join(const vector<string> &v){ string o; for(size_t i=0;i<v.size();i++){ if(i) o+='\x1f'; o+=v[i]; } return o; }
+    static vector<string> split(const string &s, char sep){ vector<string> o; if(s.empty()) return o; size_t a=0; while(true){ size_t b=s.find(sep,a); o.push_back(s.substr(a, b==string::npos?string::npos:b-a)); if(b==string::npos) break; a=b+1; } return o; }
+
+    static string serialize(const Data &d){ string o = string(HEADER)+"\n";
+        for(auto &kv: d.dirs) o += "D\t"+to_string(kv.second)+"\t"+kv.first+"\n";
+        for(auto &kv: d.files){ auto &r = kv.second.r; o += "F\t"+to_string(kv.second.mtime)+"\t"+to_string(kv.second.size)+"\t"+kv.first+"\t"+r.name+"\t"+r.version+"\t"+r.git+"\t"+r.sha256+"\t"+(r.bin_only?"1":"0")+"\t"
+                +join(r.sources)+"\t"+join(r.patches)+"\t"+join(r.depends)+"\t"+join(r.configure)+"\t"+join(r.make_cmd)+"\t"+join(r.install_cmd)+"\t"+join(r.tests)+"\n"; }
+        return o; }
+
+    static bool load(const string &p, Data &d){ string s = slurp(p); stringstream ss(s); string line; if(!getline(ss,line) || line!=HEADER) return false;
+        while(getline(ss,line)){ auto f = split(line, '\t');
+            if(f.size()==3 && f[0]=="D") d.dirs[f[2]] = atoll(f[1].c_str());
+            else if(f.size()==16 && f[0]=="F"){ FileEnt e; e.mtime=atoll(f[1].c_str()); e.size=atoll(f[2].c_str()); Recipe &r = e.r; r.path=f[3]; r.name=f[4]; r.version=f[5]; r.git=f[6]; r.sha256=f[7]; r.bin_only = f[8]=="1";
+                r.sources=split(f[9],'\x1f'); r.patches=split(f[10],'\x1f'); r.depends=split(f[11],'\x1f'); r.configure=split(f[12],'\x1f'); r.make_cmd=split(f[13],'\x1f'); r.install_cmd=split(f[14],'\x1f'); r.tests=split(f[15],'\x1f'); d.files[f[3]]=move(e); }
+            else return false; }
+        return true; }
+
+    // true if no directory or recipe.toml changed since the index was written
+    static bool fresh(const Data &d, int threads){ vector<pair<const string*,long long>> ents; ents.reserve(d.dirs.size()+d.files.size()); for(auto &kv: d.dirs) ents.emplace_back(&kv.first, kv.second); for(auto &kv: d.files) ents.emplace_back(&kv.first, kv.second.mtime);
+        atomic<bool> ok{!ents.empty()}; parallel_for(ents.size(), threads, [&](size_t i){ struct stat st; if(ok && (stat(ents[i].first->c_str(), &st)!=0 || mtime_ns(st)!=ents[i].second)) ok=false; }); return ok; }
+
+    static Data scan(const string &root, const Data &old, size_t &parsed){ Data d; error_code ec; struct stat st;
+        if(stat(root.c_str(), &st)==0) d.dirs[root]=mtime_ns(st);
+        for(auto it = filesystem::recursive_directory_iterator(root, filesystem::directory_options::skip_permission_denied, ec); !ec && it!=filesystem::recursive_directory_iterator(); it.increment(ec)){
+            string p = it->path().string(); if(it->path().filename()==".git"){ it.disable_recursion_pending(); continue; }
+            if(stat(p.c_str(), &st)!=0) continue;
+            if(S_ISDIR(st.st_mode)) d.dirs[p]=mtime_ns(st);
+            else if(it->path().filename()=="recipe.toml"){ auto o = old.files.find(p); if(o!=old.files.end() && o->second.mtime==mtime_ns(st) && o->second.size==st.st_size){ d.files[p]=o->second; continue; }
+                FileEnt e; e.mtime=mtime_ns(st); e.size=st.st_size; e.r=load_recipe_toml(p); d.files[p]=move(e); parsed++; } }
+        return d; }
+}
+
+static shared_ptr<const RecipeIndex> index_from(ridx::Data &d){ auto idx = make_shared<RecipeIndex>(); for(auto &kv: d.files) if(!kv.second.r.name.empty()) idx->recipes[kv.second.r.name] = move(kv.second.r); // map order: last path wins on duplicate names
+    for(auto &kv: idx->recipes) for(auto &dep: kv.second.depends) idx->rdeps[dep].push_back(kv.first);
+    return idx; }
+
+// loaded once per process; validated against the tree and rewritten only when something changed
+// the daemon revalidates it on every job (revalidate); concurrent queries hold the shared_ptr of the version they are reading
+static mutex ridx_mu; static shared_ptr<const RecipeIndex> ridx_cur;
+static shared_ptr<const RecipeIndex> recipe_index_ptr(const Config &c, bool revalidate=false){ { lock_guard<mutex> g(ridx_mu); if(ridx_cur && !revalidate) return ridx_cur; }
+    string p = joinp(c.state_dir, "recipes.idx"); ridx::Data d; bool loaded = ridx::load(p, d);
+    if(!loaded || !ridx::fresh(d, c.jobs)){ size_t parsed=0; d = ridx::scan(c.recipes_dir, d, parsed); if(!dump_atomic(p, ridx::serialize(d))) cerr<<ansi::yellow()<<"cannot write "<<p<<ansi::reset()<<"\n";
+        if(parsed) cerr<<ansi::cyan()<<"[index] "<<parsed<<" recipes parsed, "<<d.files.size()<<" indexed"<<ansi::reset()<<"\n"; }
+    auto idx = index_from(d); lock_guard<mutex> g(ridx_mu); ridx_cur = idx; return ridx_cur; }
+static const RecipeIndex &recipe_index(const Config &c){ return *recipe_index_ptr(c); }
+
+// ----------------- state management (installed.db binary; installed.json for import/export)
 struct InstalledInfo { string version; string installed_at; string manifest; vector<string> files; string source_hash; };
 
-static string installed_db_path(const Config &c){ return joinp(c.state_dir, "installed.json"); }
+static string installed_db_path(const Config &c){ return joinp(c.state_dir, "installed.db"); }
+static string installed_json_path(const Config &c){ return joinp(c.state_dir, "installed.json"); }
 
 // minimal json load/save (expects our simple structure)
-static unordered_map<string, InstalledInfo> load_installed(const Config &c){ unordered_map<string, InstalledInfo> out; string p = installed_db_path(c); if(!exists_file(p)) return out; string s = slurp(p); // naive parse
-    regex item(R"("([^"]+)"\s*:\s*\{([^}]*)\})"); smatch m; auto it = s.cbegin(); while(regex_search(it, s.cend(), m, item)){ string name=m[1]; string body=m[2]; InstalledInfo info; regex kv(R"("([^"]+)"\s*:\s*"?([^",}\n]+)"?)"); smatch mm; auto it2 = body.cbegin(); while(regex_search(it2, body.cend(), mm, kv)){ string k=mm[1], v=mm[2]; if(k=="version") info.version = v; else if(k=="installed_at") info.installed_at = v; else if(k=="manifest") info.manifest = v; else if(k=="source_hash") info.source_hash = v; it2 = mm.suffix().first; }
+static unordered_map<string, InstalledInfo> load_installed_json(const string &p){ unordered_map<string, InstalledInfo> out; if(!exists_file(p)) return out; string s = slurp(p); // naive parse
+    regex item(R"re("([^"]+)"\s*:\s*\{([^}]*)\})re"); smatch m; auto it = s.cbegin(); while(regex_search(it, s.cend(), m, item)){ string name=m[1]; string body=m[2]; InstalledInfo info; regex kv(R"re("([^"]+)"\s*:\s*"?([^",}\n]+)"?)re"); smatch mm; auto it2 = body.cbegin(); while(regex_search(it2, body.cend(), mm, kv)){ string k=mm[1], v=trim(mm[2]); if(k=="version") info.version = v; else if(k=="installed_at") info.installed_at = v; else if(k=="manifest") info.manifest = v; else if(k=="source_hash") info.source_hash = v; it2 = mm.suffix().first; }
         // files array
-        regex fa(R"("files"\s*:\s*\[(.*?)\])", regex::dotall);
-        smatch fm; if(regex_search(body,fm,fa)){ string arr=fm[1]; regex itf(R"("([^"]+)")"); auto it3=arr.cbegin(); smatch im; while(regex_search(it3, arr.cend(), im, itf)){ info.files.push_back(im[1]); it3 = im.suffix().first; } }
+        regex fa(R"re("files"\s*:\s*\[([\s\S]*?)\])re");
+        smatch fm; if(regex_search(body,fm,fa)){ string arr=fm[1]; regex itf(R"re("([^"]+)")re"); auto it3=arr.cbegin(); smatch im; while(regex_search(it3, arr.cend(), im, itf)){ info.files.push_back(im[1]); it3 = im.suffix().first; } }
         out[name]=info; it = m.suffix().first;
     }
     return out;
 }
 
-static void save_installed(const Config &c, const unordered_map<string, InstalledInfo> &db){ string p = installed_db_path(c); string out = "{\n"; for(auto &kv: db){ out += "  \""+kv.first+"\": {\n"; out += "    \"version\": \""+kv.second.version+"\",\n"; out += "    \"installed_at\": \""+kv.second.installed_at+"\",\n"; out += "    \"manifest\": \""+kv.second.manifest+"\",\n"; out += "    \"source_hash\": \""+kv.second.source_hash+"\",\n"; out += "    \"files\": [\n"; for(auto &f: kv.second.files) out += "      \""+f+"\","+"\n"; out += "    ]\n  },\n"; } out += "}\n"; dump(p,out); }
+static bool save_installed_json(const string &p, const unordered_map<string, InstalledInfo> &db){ vector<string> names; for(auto &kv: db) names.push_back(kv.first); sort(names.begin(), names.end()); string out = "{\n";
+    for(size_t i=0;i<names.size();i++){ auto &info = db.at(names[i]); out += "  \""+names[i]+"\": {\n"; out += "    \"version\": \""+info.version+"\",\n"; out += "    \"installed_at\": \""+info.installed_at+"\",\n"; out += "    \"manifest\": \""+info.manifest+"\",\n"; out += "    \"source_hash\": \""+info.source_hash+"\",\n"; out += "    \"files\": [";
+        for(size_t j=0;j<info.files.size();j++) out += (j?",\n      \"":"\n      \"")+info.files[j]+"\""; out += "\n    ]\n  }"+string(i+1<names.size()?",":"")+"\n"; }
+    out += "}\n"; return dump_atomic(p,out); }
+
+// installed.db: Header | Pkg[npkgs] sorted by name | File[nfiles] sorted by path (owner index) | uint32 pkgfiles[] (File ids of each pkg) | string pool
+// Each path appears once in the pool; the file is read through mmap, with no parsing.
+namespace idb {
+    struct Str { uint64_t off; uint32_t len, pad; };
+    struct Header { char magic[8]; uint32_t version, npkgs; uint64_t nfiles, npkgfiles, pkgs_off, files_off, pkgfiles_off, pool_off, pool_size, size; };
+    struct Pkg { Str name, version, installed_at, manifest, source_hash; uint64_t files_first, files_count; };
+    struct File { Str path; uint32_t pkg, pad; };
+    static const char MAGIC[8] = {'L','F','S','D','I','D','B','\0'}; static const uint32_t VERSION = 1;
+
+    struct View { // read-only mmap of installed.db
+        const char *base=nullptr; size_t len=0; const Header *h=nullptr;
+        View(){} View(const View&)=delete; View &operator=(const View&)=delete;
+        ~View(){ if(base) munmap((void*)base, len); }
+        bool open(const string &p){ int fd = ::open(p.c_str(), O_RDONLY|O_CLOEXEC); if(fd<0) return false; struct stat st; if(fstat(fd,&st)!=0 || st.st_size<(off_t)sizeof(Header)){ close(fd); return false; }
+            void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0); close(fd); if(m==MAP_FAILED) return false; base=(const char*)m; len=st.st_size; h=(const Header*)base;
+            auto in = [&](uint64_t off, uint64_t n, size_t sz){ return off<=len && n<=(len-off)/sz; };
+            bool ok = memcmp(h->magic, MAGIC, 8)==0 && h->version==VERSION && h->size==len && in(h->pkgs_off,h->npkgs,sizeof(Pkg)) && in(h->files_off,h->nfiles,sizeof(File)) && in(h->pkgfiles_off,h->npkgfiles,sizeof(uint32_t)) && in(h->pool_off,h->pool_size,1);
+            if(!ok){ munmap(m, len); base=nullptr; h=nullptr; len=0; } return ok; }
+        size_t npkgs() const { return h?h->npkgs:0; }
+        const Pkg *pkgs() const { return (const Pkg*)(base+h->pkgs_off); }
+        const File *files() const { return (const File*)(base+h->files_off); }
+        string_view str(const Str &s) const { return s.off+s.len<=h->pool_size ? string_view(base+h->pool_off+s.off, s.len) : string_view(); }
+        const Pkg *find(string_view name) const { if(!h) return nullptr; auto b=pkgs(), e=b+h->npkgs; auto it = lower_bound(b, e, name, [&](const Pkg &p, string_view n){ return str(p.name)<n; }); return (it!=e && str(it->name)==name)?it:nullptr; }
+        const Pkg *owner(string_view path) const { if(!h) return nullptr; auto b=files(), e=b+h->nfiles; auto it = lower_bound(b, e, path, [&](const File &f, string_view v){ return str(f.path)<v; }); return (it!=e && str(it->path)==path && it->pkg<h->npkgs)?&pkgs()[it->pkg]:nullptr; }
+        InstalledInfo info(const Pkg &p) const { InstalledInfo i; i.version=str(p.version); i.installed_at=str(p.installed_at); i.manifest=str(p.manifest); i.source_hash=str(p.source_hash);
+            auto ids = (const uint32_t*)(base+h->pkgfiles_off); if(p.files_first+p.files_count<=h->npkgfiles){ i.files.reserve(p.files_count); for(uint64_t k=0;k<p.files_count;k++){ uint32_t id = ids[p.files_first+k]; if(id<h->nfiles) i.files.emplace_back(str(files()[id].path)); } }
+            return i; }
+    };
+
+    static string serialize(const unordered_map<string, InstalledInfo> &db){
+        string pool; unordered_map<string_view, uint64_t> interned;
+        auto intern = [&](string_view v){ auto it = interned.find(v); if(it!=interned.end()) return Str{it->second,(uint32_t)v.size(),0}; Str r{pool.size(),(uint32_t)v.size(),0}; pool.append(v.data(), v.size()); interned.emplace(v, r.off); return r; }; // v must outlive serialize()
+        vector<string> names; for(auto &kv: db) names.push_back(kv.first); sort(names.begin(), names.end());
+        vector<Pkg> pkgs; vector<uint32_t> pkgfiles; struct Ref { string_view path; uint32_t pkg; uint64_t slot; }; vector<Ref> refs;
+        for(uint32_t i=0;i<names.size();i++){ auto &in = db.at(names[i]); pkgs.push_back({intern(names[i]), intern(in.version), intern(in.installed_at), intern(in.manifest), intern(in.source_hash), pkgfiles.size(), in.files.size()});
+            for(auto &f: in.files){ refs.push_back({f, i, pkgfiles.size()}); pkgfiles.push_back(0); } }
+        sort(refs.begin(), refs.end(), [](const Ref &a, const Ref &b){ return a.path!=b.path ? a.path<b.path : a.pkg<b.pkg; }); // duplicates: the last package by name owns the path
+        vector<File> files; files.reserve(refs.size());
+        for(auto &r: refs){ if(files.empty() || r.path!=refs[&r-&refs[0]-1].path){ Str st{pool.size(),(uint32_t)r.path.size(),0}; pool.append(r.path.data(), r.path.size()); files.push_back({st, r.pkg, 0}); } else files.back().pkg = r.pkg; pkgfiles[r.slot] = files.size()-1; }
+        Header h; memset(&h, 0, sizeof(h)); memcpy(h.magic, MAGIC, 8); h.version=VERSION; h.npkgs=pkgs.size(); h.nfiles=files.size(); h.npkgfiles=pkgfiles.size();
+        h.pkgs_off=sizeof(Header); h.files_off=h.pkgs_off+pkgs.size()*sizeof(Pkg); h.pkgfiles_off=h.files_off+files.size()*sizeof(File); h.pool_off=h.pkgfiles_off+pkgfiles.size()*sizeof(uint32_t); h.pool_size=pool.size(); h.size=h.pool_off+pool.size();
+        string out; out.reserve(h.size); out.append((const char*)&h, sizeof(h)); out.append((const char*)pkgs.data(), pkgs.size()*sizeof(Pkg)); out.append((const char*)files.data(), files.size()*sizeof(File)); out.append((const char*)pkgfiles.data(), pkgfiles.size()*sizeof(uint32_t)); out += pool;
+        return out; }
+}
+
+// writers of installed.db hold installed.db.lock from load to save, so concurrent lfsd processes don't drop each other's changes;
+// reentrant within the process (apply -> undo_txn, load_installed -> the one-time installed.json import)
+struct DbLock { static inline recursive_mutex mu; static inline int depth = 0; static inline unique_ptr<FileLock> held;
+    explicit DbLock(const Config &c){ mu.lock(); if(depth++==0) held.reset(new FileLock(joinp(c.state_dir, "installed.db.lock"))); }
+    ~DbLock(){ if(--depth==0) held.reset(); mu.unlock(); } DbLock(const DbLock&)=delete; DbLock &operator=(const DbLock&)=delete; };
+
+static void save_installed(const Config &c, const unordered_map<string, InstalledInfo> &db){ string p = installed_db_path(c); if(!dump_atomic(p, idb::serialize(db))) cerr<<ansi::red()<<"cannot write "<<p<<": "<<strerror(errno)<<ansi::reset()<<"\n"; }
+
+// mmap installed.db; on first use an existing installed.json is imported once. false = no db (or corrupt)
+static bool open_installed(const Config &c, idb::View &v){ string p = installed_db_path(c);
+    if(!exists_file(p)){ if(!exists_file(installed_json_path(c))) return false; DbLock lk(c);
+        if(!exists_file(p)){ cerr<<ansi::yellow()<<"[db] importing "<<installed_json_path(c)<<ansi::reset()<<"\n"; save_installed(c, load_installed_json(installed_json_path(c))); } }
+    if(!v.open(p)){ cerr<<ansi::red()<<"corrupt "<<p<<"; use `lfsd db import` to rebuild it"<<ansi::reset()<<"\n"; return false; } return true; }
+
+static unordered_map<string, InstalledInfo> load_installed(const Config &c){ unordered_map<string, InstalledInfo> out; idb::View v; if(!open_installed(c, v)) return out;
+    out.reserve(v.npkgs()); for(size_t i=0;i<v.npkgs();i++){ auto &pk = v.pkgs()[i]; out.emplace(string(v.str(pk.name)), v.info(pk)); } return out; }
+
+// ----------------- manifests ("<path> <sha256> <size> <mtime>" per line; old files have only "<path> <sha256>")
+struct ManifestEntry { string path, sha256; long long size=-1, mtime=-1; };
+
+static bool all_digits(const string &s){ return !s.empty() && all_of(s.begin(), s.end(), [](char ch){ return isdigit((unsigned char)ch); }); }
+
+static vector<ManifestEntry> load_manifest(const string &p){ vector<ManifestEntry> out; string s = slurp(p); stringstream ss(s); string line;
+    while(getline(ss,line)){ if(line.empty()) continue; ManifestEntry e; size_t a = line.rfind(' '); if(a==string::npos) continue;
+        size_t b = a?line.rfind(' ', a-1):string::npos, h = (b!=string::npos && b)?line.rfind(' ', b-1):string::npos;
+        if(h!=string::npos && b-h-1==64 && all_digits(line.substr(b+1, a-b-1)) && all_digits(line.substr(a+1))){ e.path=line.substr(0,h); e.sha256=line.substr(h+1,64); e.size=stoll(line.substr(b+1, a-b-1)); e.mtime=stoll(line.substr(a+1)); }
+        else { e.path=line.substr(0,a); e.sha256=line.substr(a+1); }
+        out.push_back(e); }
+    return out; }
 
 // ----------------- dependency resolver (topo sort)
 static vector<string> topo_sort(const unordered_map<string, vector<string>> &deps){ unordered_map<string,int> indeg; unordered_map<string, vector<string>> adj; for(auto &kv: deps){ auto pkg=kv.first; if(!indeg.count(pkg)) indeg[pkg]=0; for(auto &d: kv.second){ adj[d].push_back(pkg); indeg[pkg]++; if(!indeg.count(d)) indeg[d]=0; } }
@@ -145,154 +401,865 @@ static vector<string> topo_sort(const unordered_map<string, vector<string>> &dep
     if(order.size()!=indeg.size()) throw runtime_error("ciclo detectado nas dependências"); return order; }
 
 // ----------------- download manager ----------------
-static int download_with_curl(const string &url, const string &out){ string cmd = "curl -L --fail --retry 3 -o '"+out+"' '"+url+"'"; return run(cmd); }
-static int git_clone_shallow(const string &url, const string &out){ string cmd = "rm -rf '"+out+"' && git clone --depth 1 '"+url+"' '"+out+"'"; return run(cmd); }
+// -C -: continues a partial download left in `out`
+static int download_with_curl(const string &url, const string &out){ string cmd = "curl -sS -L --fail --retry 3 -C - -o '"+out+"' '"+url+"'"; return run(cmd); }
+// incremental: an existing checkout is fetched and reset instead of re-cloned
+static int git_fetch_incremental(const string &url, const string &out){
+    if(filesystem::exists(joinp(out,".git"))) return run("git -C '"+out+"' fetch -q --depth 1 '"+url+"' HEAD && git -C '"+out+"' reset -q --hard FETCH_HEAD && git -C '"+out+"' clean -qfdx");
+    return run("rm -rf '"+out+"' && git clone -q --depth 1 '"+url+"' '"+out+"'"); }
+
+// ----------------- source cache (sources_dir/by-sha256) ----------------
+// Sources live in by-sha256/<digest>; by-url/<sha256(url)> holds the digest of the URL's last download;
+// incomplete downloads stay in partial/ and are resumed. A per-URL flock serializes concurrent builds/processes.
+static string hex_of(const string &v){ sha256::Ctx x; sha256::update(x, v.data(), v.size()); return sha256::final_hex(x); }
+
+
+static string git_cache_dir(const Config &c, const string &url){ return joinp(c.sources_dir, "git/"+hex_of(url).substr(0,16)); }
+// flock on <git_cache_dir>.lock; sources_dir/git must exist first, or open() fails with ENOENT and nothing is locked
+static string git_lock_path(const Config &c, const string &url){ ensure_dir(joinp(c.sources_dir, "git")); return git_cache_dir(c, url)+".lock"; }
+
+// cached path of url, downloading it if needed ("" on failure); expected = declared sha256, may be empty
+// refresh = download an unpinned url again even if cached (the cached copy is kept as a fallback when that fails)
+static string fetch_source(const Config &c, const string &url, const string &expected, bool refresh=false){ error_code ec;
+    string bydig = joinp(c.sources_dir, "by-sha256"), byurl = joinp(c.sources_dir, "by-url"), partial = joinp(c.sources_dir, "partial"), uk = hex_of(url);
+    auto cached = [&]()->string{ if(!expected.empty()) return exists_file(joinp(bydig, expected)) ? joinp(bydig, expected) : string();
+        string d = trim(slurp(joinp(byurl, uk))); return (!d.empty() && exists_file(joinp(bydig, d))) ? joinp(bydig, d) : string(); };
+    refresh = refresh && expected.empty(); string hit = cached(); if(!hit.empty() && !refresh) return hit;
+    for(auto &d: {bydig, byurl, partial}) filesystem::create_directories(d, ec);
+    string part = joinp(partial, uk); FileLock lock(part+".lock");
+    hit = cached(); if(!hit.empty() && !refresh) return hit; // another build finished it while we waited
+    errln(ansi::cyan()+"[download] "+url+(exists_file(part)?" (resuming)":"")+ansi::reset());
+    int rc = download_with_curl(url, part);
+    if(rc!=0 && exists_file(part)){ unlink(part.c_str()); rc = download_with_curl(url, part); } // server without ranges, or stale partial: start over
+    if(rc!=0 && !hit.empty()){ errln(ansi::yellow()+"download failed: "+url+"; using the cached copy"+ansi::reset()); return hit; }
+    if(rc!=0){ errln(ansi::red()+"download failed: "+url+ansi::reset()); return string(); }
+    string h = sha256_file(part); if(h.empty() || (!expected.empty() && h!=expected)){ errln(ansi::red()+"SHA256 mismatch for "+url+ansi::reset()); unlink(part.c_str()); return string(); }
+    string dest = joinp(bydig, h); if(rename(part.c_str(), dest.c_str())!=0) return string(); dump_atomic(joinp(byurl, uk), h+"\n"); return dest; }
+
+// ----------------- prefetch (fetch stage) ----------------
+// Downloads sources, patches and git repositories of all recipes at once, up to `limit` concurrent downloads.
+static int prefetch(const Config &c, const vector<const Recipe*> &rs, int limit){ struct Job { string url, sha; bool git; string pkg; }; vector<Job> jobs; set<string> seen;
+    for(auto r: rs){ if(!r->git.empty()){ if(seen.insert(r->git).second) jobs.push_back({r->git, "", true, r->name}); continue; }
+        for(auto &u: r->sources) if(seen.insert(u).second) jobs.push_back({u, r->sha256, false, r->name});
+        for(auto &u: r->patches) if(seen.insert(u).second) jobs.push_back({u, "", false, r->name}); }
+    if(jobs.empty()) return 0;
+    auto t0 = chrono::steady_clock::now(); atomic<int> failed{0};
+    errln(ansi::cyan()+"[fetch] "+to_string(jobs.size())+" sources, "+to_string(max(1,limit))+" at a time"+ansi::reset());
+    parallel_for(jobs.size(), limit, [&](size_t i){ auto &j = jobs[i]; trace::Span sp(j.pkg, "download");
+        if(j.git){ string dir = git_cache_dir(c, j.url); FileLock lock(git_lock_path(c, j.url)); if(git_fetch_incremental(j.url, dir)!=0){ errln(ansi::red()+"git fetch failed: "+j.url+ansi::reset()); failed++; } }
+        else if(fetch_source(c, j.url, j.sha).empty()) failed++; });
+    char dur[32]; snprintf(dur, sizeof(dur), "%.1fs", secs_since(t0));
+    errln((failed?ansi::red():ansi::green())+"[fetch] done in "+dur+", "+to_string(failed)+" failed"+ansi::reset());
+    return failed?1:0; }
+
+// ----------------- build cache (content-addressed artifacts in bin_dir) ----------------
+// The key covers recipe.toml, source/patch digests, the build environment and the keys of the dependencies.
+namespace bcache { atomic<long> hits{0}, misses{0}; }
+
+static const char *const BUILD_ENV[] = {"CC","CXX","CFLAGS","CXXFLAGS","CPPFLAGS","LDFLAGS"}; // part of the build key
+static bool build_env_var(const string &kv){ for(const char *e: BUILD_ENV){ size_t n = strlen(e); if(kv.compare(0, n, e)==0 && kv.size()>n && kv[n]=='=') return true; } return false; }
+
+// what the recipe text does not pin: the upstream commit of a git source and the contents of each patch.
+// Patches are small and fetched again every time (a changed file behind the same URL must change the key).
+static vector<string> source_inputs(const Config &c, const Recipe &r){ vector<string> in;
+    if(!r.git.empty()){ string h = caprun("git ls-remote '"+r.git+"' HEAD 2>/dev/null").substr(0, 40);
+        if(h.size()!=40 || !all_of(h.begin(), h.end(), ::isxdigit)){ h = trim(caprun("git -C '"+git_cache_dir(c, r.git)+"' rev-parse HEAD 2>/dev/null"));
+            errln(ansi::yellow()+"[key] cannot reach "+r.git+(h.empty()?"":"; using the cached checkout")+ansi::reset()); }
+        in.push_back("git "+h); }
+    for(auto &p: r.patches){ string f = fetch_source(c, p, "", true); in.push_back("patch "+(f.empty()?string("-"):filesystem::path(f).filename().string())); } // by-sha256/<digest>
+    return in; }
+
+static string build_key(const Recipe &r, bool strip, const vector<string> &dep_keys, const vector<string> &inputs){ sha256::Ctx x; auto add = [&](const string &v){ sha256::update(x, v.data(), v.size()); sha256::update(x, "", 1); };
+    add("lfsd-build-key 2"); // 2: artifacts packed before the pax length fix may be corrupt
+    add(slurp(r.path)); add(r.sha256); add(r.git); for(auto &u: r.sources) add(u); for(auto &u: r.patches) add(u); for(auto &v: inputs) add(v);
+    for(const char *e: BUILD_ENV){ const char *v = getenv(e); add(string(e)+"="+(v?v:"")); }
+    struct utsname u; if(uname(&u)==0) add(u.machine); add(strip?"strip":"nostrip");
+    for(auto &k: dep_keys) add(k); return sha256::final_hex(x); }
+
+static string cache_stats_path(const Config &c){ return joinp(c.state_dir, "buildcache.stats"); }
+static map<string,long> load_cache_stats(const Config &c){ map<string,long> m; stringstream ss(slurp(cache_stats_path(c))); string k; long v; while(ss>>k>>v) m[k]=v; return m; }
+static void add_cache_stats(const Config &c, long hits, long misses, long skipped){ if(!hits && !misses && !skipped) return; auto m = load_cache_stats(c); m["hits"]+=hits; m["misses"]+=misses; m["skipped"]+=skipped;
+    string out; for(auto &kv: m) out += kv.first+" "+to_string(kv.second)+"\n"; dump_atomic(cache_stats_path(c), out); }
+
+// "20G", "512M", "1T" or bytes
+static long long parse_size(const string &s){ char *end=nullptr; double v = strtod(s.c_str(), &end); switch(end?toupper((unsigned char)*end):0){ case 'K': v*=1024; break; case 'M': v*=1024.0*1024; break; case 'G': v*=1024.0*1024*1024; break; case 'T': v*=1024.0*1024*1024*1024; break; } return (long long)v; }
+
+static vector<pair<string,struct stat>> cache_artifacts(const Config &c){ vector<pair<string,struct stat>> out; error_code ec;
+    for(auto &e: filesystem::directory_iterator(c.bin_dir, ec)){ string p = e.path().string(); struct stat st; if(p.size()>8 && p.compare(p.size()-8, 8, ".tar.zst")==0 && stat(p.c_str(), &st)==0 && S_ISREG(st.st_mode)) out.emplace_back(p, st); }
+    return out; }
+
+static int cmd_cache(const Config &c, const vector<string> &args){ string sub = args.empty()?"stats":args[0];
+    if(sub=="stats"){ auto m = load_cache_stats(c); auto arts = cache_artifacts(c); long long total=0; for(auto &a: arts) total += a.second.st_size; long lookups = m["hits"]+m["misses"];
+        cout<<"hits "<<m["hits"]<<", misses "<<m["misses"]<<", up-to-date "<<m["skipped"]; if(lookups) cout<<" ("<<(100*m["hits"]/lookups)<<"% hit rate)"; cout<<"\n";
+        cout<<arts.size()<<" artifacts, "<<(total>>20)<<" MiB (cap "<<(parse_size(c.cache_max_size)>>20)<<" MiB)\n"; return 0; }
+    if(sub=="gc"){ long long cap = parse_size(c.cache_max_size); for(size_t i=1;i+1<args.size();i++) if(args[i]=="--max-size") cap = parse_size(args[i+1]);
+        auto arts = cache_artifacts(c); long long total=0; for(auto &a: arts) total += a.second.st_size;
+        sort(arts.begin(), arts.end(), [](auto &a, auto &b){ return a.second.st_mtim.tv_sec!=b.second.st_mtim.tv_sec ? a.second.st_mtim.tv_sec<b.second.st_mtim.tv_sec : a.second.st_mtim.tv_nsec<b.second.st_mtim.tv_nsec; }); // least recently used first
+        size_t removed=0; for(auto &a: arts){ if(total<=cap) break; if(unlink(a.first.c_str())==0){ total -= a.second.st_size; removed++; cout<<"evicted "<<a.first<<"\n"; } }
+        cout<<"removed "<<removed<<" artifacts, "<<(total>>20)<<" MiB left\n"; return 0; }
+    cerr<<"uso: lfsd cache stats|gc [--max-size SIZE]\n"; return 1; }
+
+// ----------------- packager (one walk: ELF strip, sha256, tar | zstd -T) ----------------
+// Each stage file is read only once: the same buffer feeds the manifest's sha256 and the tar, which zstd compresses
+// in parallel. ELF is detected by its magic; strip gets the files in a batch.
+struct StageEntry { string rel; struct stat st; char type; string link; int elf=0; }; // type: tar typeflag ('5' dir, '0' file, '1' hardlink, '2' symlink); elf = e_type
+
+static int elf_type(const string &p){ int fd = open(p.c_str(), O_RDONLY|O_CLOEXEC); if(fd<0) return 0; unsigned char h[18]; ssize_t n = read(fd, h, sizeof(h)); close(fd);
+    if(n<18 || memcmp(h, "\x7f" "ELF", 4)!=0) return 0; return h[5]==2 ? (h[16]<<8|h[17]) : (h[17]<<8|h[16]); } // EI_DATA: 1 little, 2 big endian
+
+// sorted walk (reproducible archives); hardlinks are recorded once, later names point at the first one
+static void walk_stage(const string &root, const string &rel, vector<StageEntry> &out, map<pair<dev_t,ino_t>,string> &inodes){ error_code ec; vector<string> names;
+    for(auto &e: filesystem::directory_iterator(joinp(root, rel), ec)) names.push_back(e.path().filename().string()); sort(names.begin(), names.end());
+    for(auto &n: names){ StageEntry e; e.rel = rel.empty()?n:rel+"/"+n; string full = joinp(root, e.rel); if(lstat(full.c_str(), &e.st)!=0) continue;
+        if(S_ISDIR(e.st.st_mode)){ e.type='5'; out.push_back(e); walk_stage(root, e.rel, out, inodes); continue; }
+        if(S_ISLNK(e.st.st_mode)){ e.type='2'; char buf[PATH_MAX]; ssize_t k = readlink(full.c_str(), buf, sizeof(buf)); if(k<0) continue; e.link.assign(buf, k); out.push_back(e); continue; }
+        if(!S_ISREG(e.st.st_mode)){ errln(ansi::yellow()+"[pack] skipping special file "+e.rel+ansi::reset()); continue; }
+        if(e.st.st_nlink>1){ auto key = make_pair(e.st.st_dev, e.st.st_ino); auto it = inodes.find(key); if(it!=inodes.end()){ e.type='1'; e.link=it->second; out.push_back(e); continue; } inodes[key]=e.rel; }
+        e.type='0'; e.elf = elf_type(full); out.push_back(e); }
+}
+
+struct TarWriter { FILE *f=nullptr; bool ok=true; uint64_t written=0;
+    void put(const void *p, size_t n){ if(ok && n && fwrite(p, 1, n, f)!=n) ok=false; written+=n; }
+    void pad(){ static const char z[512]={0}; if(written%512) put(z, 512-written%512); }
+    // len-1 octal digits and a NUL; a value that does not fit is written as 0 and carried by a pax record (header())
+    static bool fits(size_t len, uint64_t v){ return v < (1ULL<<(3*(len-1))); }
+    static void octal(char *dst, size_t len, uint64_t v){ if(!fits(len, v)) v = 0; dst[len-1] = 0; for(size_t i=len-1; i-->0; v>>=3) dst[i] = char('0'+(v&7)); }
+    void block(const string &name, const struct stat &st, char type, uint64_t size, const string &link){ char h[512]; memset(h, 0, sizeof(h));
+        memcpy(h, name.data(), min<size_t>(name.size(), 100)); octal(h+100, 8, st.st_mode&07777); octal(h+108, 8, st.st_uid); octal(h+116, 8, st.st_gid); octal(h+124, 12, size); octal(h+136, 12, st.st_mtime);
+        h[156]=type; memcpy(h+157, link.data(), min<size_t>(link.size(), 100)); memcpy(h+257, "ustar", 6); memcpy(h+263, "00", 2);
+        memset(h+148, ' ', 8); unsigned sum=0; for(unsigned char ch: h) sum+=ch; snprintf(h+148, 8, "%06o", sum); h[155]=' '; put(h, 512); }
+    // pax extended header when a name/link does not fit in ustar, or size/uid/gid/mtime need more octal digits than the field has
+    void header(const string &name, const struct stat &st, char type, uint64_t size, const string &link){ string pax;
+        auto rec = [&](const string &k, const string &v){ string body = " "+k+"="+v+"\n"; // record length counts its own digits: iterate L = body + digits(L) to a fixed point
+            size_t len = body.size()+1; for(size_t n; (n = body.size()+to_string(len).size())!=len; ) len = n; pax += to_string(len)+body; };
+        if(name.size()>100) rec("path", name); if(link.size()>100) rec("linkpath", link); if(!fits(12, size)) rec("size", to_string(size));
+        if(!fits(8, st.st_uid)) rec("uid", to_string(st.st_uid)); if(!fits(8, st.st_gid)) rec("gid", to_string(st.st_gid)); if(!fits(12, (uint64_t)st.st_mtime)) rec("mtime", to_string((long long)st.st_mtime));
+        if(!pax.empty()){ struct stat px = st; px.st_mode = 0644; block("././@PaxHeader", px, 'x', pax.size(), ""); put(pax.data(), pax.size()); pad(); }
+        block(name, st, type, type=='0'?size:0, link); }
+    void finish(){ static const char z[1024]={0}; put(z, sizeof(z)); }
+};
+
+// manifest hash of an installed path: file contents, or the target string for symlinks
+static string installed_hash(const string &p){ struct stat st; if(lstat(p.c_str(), &st)!=0) return string(); if(!S_ISLNK(st.st_mode)) return sha256_file(p);
+    char buf[PATH_MAX]; ssize_t k = readlink(p.c_str(), buf, sizeof(buf)); return k<0 ? string() : hex_of(string(buf, k)); }
+
+// walks `root` once; strips ELF files if asked, hashes every regular file and, if artifact is set, streams the tree into it.
+// Returns 0 on success and fills the manifest entries (target paths, relative to /).
+static int package_stage(const string &root, const string &artifact, bool strip, int jobs, vector<ManifestEntry> &mani, const string &pkg){
+    vector<StageEntry> ents; map<pair<dev_t,ino_t>,string> inodes; walk_stage(root, "", ents, inodes);
+    if(strip){ trace::Span sp(pkg, "strip"); vector<string> exe, lib; for(auto &e: ents){ if(e.elf==2) exe.push_back(joinp(root, e.rel)); else if(e.elf==3) lib.push_back(joinp(root, e.rel)); } // ET_EXEC / ET_DYN; objects (ET_REL) are left alone
+        auto batch = [&](const vector<string> &fs, const string &flag){ for(size_t i=0;i<fs.size();i+=200){ string cmd = "strip "+flag; for(size_t k=i;k<min(fs.size(),i+200);k++) cmd += " '"+fs[k]+"'"; run(cmd+" || true"); } };
+        batch(exe, "--strip-all"); batch(lib, "--strip-unneeded");
+        for(auto &e: ents) if(e.elf==2 || e.elf==3) lstat(joinp(root, e.rel).c_str(), &e.st);
+        unordered_map<string,const struct stat*> target; for(auto &e: ents) if(e.type=='0') target[e.rel] = &e.st;
+        for(auto &e: ents) if(e.type=='1' && target.count(e.link)) e.st = *target[e.link]; } // hardlinks install the stripped target, whatever strip did to the alias
+    unordered_map<string,string> digest; // rel -> sha256, for hardlinks
+    auto add_entry = [&](const StageEntry &e, const string &h){ ManifestEntry m; m.path = "/"+e.rel; m.sha256 = h; m.size = e.type=='2'?(long long)e.link.size():(long long)e.st.st_size; m.mtime = e.st.st_mtime; mani.push_back(m); };
+    if(artifact.empty()){ trace::Span sp(pkg, "manifest"); // no archive: hash on the thread pool
+        vector<string> files; for(auto &e: ents) if(e.type=='0') files.push_back(joinp(root, e.rel)); auto hs = sha256_files(files, jobs); size_t k=0;
+        for(auto &e: ents){ if(e.type=='0') digest[e.rel] = hs[k++]; }
+        for(auto &e: ents){ if(e.type=='0') add_entry(e, digest[e.rel]); else if(e.type=='1') add_entry(e, digest[e.link]); else if(e.type=='2') add_entry(e, hex_of(e.link)); }
+        for(auto &m: mani) if(m.sha256.empty()) return 1; return 0; }
+    trace::Span sp(pkg, "pack"); // hashing for the manifest happens in the same pass
+    TarWriter tw; tw.f = popen(("zstd -q -f -T"+to_string(max(1,jobs))+" -o '"+artifact+"'").c_str(), "w"); if(!tw.f) return 1;
+    static thread_local vector<char> buf(1<<20); setvbuf(tw.f, nullptr, _IOFBF, 1<<20);
+    for(auto &e: ents){ string name = "./"+e.rel+(e.type=='5'?"/":"");
+        if(e.type=='5'){ tw.header(name, e.st, '5', 0, ""); continue; }
+        if(e.type=='2'){ tw.header(name, e.st, '2', 0, e.link); add_entry(e, hex_of(e.link)); continue; }
+        if(e.type=='1'){ tw.header(name, e.st, '1', 0, "./"+e.link); add_entry(e, digest[e.link]); continue; }
+        int fd = open(joinp(root, e.rel).c_str(), O_RDONLY|O_CLOEXEC); if(fd<0){ tw.ok=false; break; }
+        tw.header(name, e.st, '0', e.st.st_size, ""); sha256::Ctx x; uint64_t left = e.st.st_size; ssize_t n;
+        while(left && (n = read(fd, buf.data(), min<uint64_t>(buf.size(), left)))!=0){ if(n<0){ if(errno==EINTR) continue; tw.ok=false; break; } sha256::update(x, buf.data(), n); tw.put(buf.data(), n); left -= n; }
+        close(fd); if(left) tw.ok=false; tw.pad(); digest[e.rel] = sha256::final_hex(x); add_entry(e, digest[e.rel]); if(!tw.ok) break; }
+    tw.finish(); int rc = pclose(tw.f); if(!tw.ok || rc!=0){ unlink(artifact.c_str()); return 1; }
+    return 0; }
 
 // ----------------- build one package ----------------
-static int build_one(const Recipe &r, const Config &c, unordered_map<string, InstalledInfo> &installed, const string &work_root, bool do_strip, bool do_pack){ // returns 0 on success
-    string work = joinp(work_root, r.name+"-"+r.version);
-    string srcdir = joinp(c.sources_dir, r.name+"-"+r.version);
-    run("rm -rf '"+work+"' && mkdir -p '"+work+"'");
-    // download
-    if(!r.git.empty()){
-        cerr<<ansi::cyan()<<"[download] git "<<r.git<<ansi::reset()<<"\n";
-        if(git_clone_shallow(r.git, srcdir)!=0) return 1;
-    } else if(!r.sources.empty()){
-        ensure_dir(c.sources_dir);
-        for(auto &u: r.sources){ string fname = joinp(c.sources_dir, r.name+"-"+r.version+"-"+to_string(rand())); string ext = fname; fname += ".src"; if(download_with_curl(u,fname)!=0) return 2; // verify sha if provided
-            if(!r.sha256.empty()){ string h = sha256_file(fname); if(h.empty()||h!=r.sha256){ cerr<<ansi::red()<<"SHA256 mismatch for "<<u<<ansi::reset()<<"\n"; return 3; } }
-            // unpack
-            run("tar -C '"+work+"' -xf '"+fname+"' --strip-components=1"); }
-    }
-    // if git clone, copy into work
-    if(!r.git.empty()) run("cp -a '"+srcdir+"/.' '"+work+"/'");
-    // apply patches
-    if(!r.patches.empty()){
-        for(auto &purl: r.patches){ string pfile = joinp(work, "patch-"+to_string(rand())); if(download_with_curl(purl,pfile)!=0) return 4; run("cd '"+work+"' && patch -p1 < '"+pfile+"'"); }
-    }
-    // env
-    vector<pair<string,string>> envs = {{"STAGE", joinp(c.stage_dir, r.name+"-"+r.version)}, {"JOBS", to_string(c.jobs)}};
-    ensure_dir(envs[0].second);
-    // run steps
-    auto run_step = [&](const vector<string> &cmds){ for(auto &cmm: cmds){ string cmdline = "cd '"+work+"' && "; // replace ${STAGE}, ${JOBS}
-                string s=cmm; size_t pos; while((pos=s.find("${STAGE}"))!=string::npos) s.replace(pos,8,envs[0].second); while((pos=s.find("${JOBS}"))!=string::npos) s.replace(pos,7,to_string(c.jobs)); cmdline += s; int rc = run(cmdline); if(rc!=0) return rc; } return 0; };
-    if(!r.configure.empty()){ if(run_step(r.configure)) return 10; }
-    if(!r.make_cmd.empty()){ if(run_step(r.make_cmd)) return 11; }
-    if(!r.tests.empty()){ if(run_step(r.tests)) return 12; }
-    if(!r.install_cmd.empty()){ if(run_step(r.install_cmd)) return 13; }
-    // generate manifest
-    vector<string> files;
-    string pkgroot = envs[0].second; // staged install path
-    // find files under pkgroot
-    for(auto &p: filesystem::recursive_directory_iterator(pkgroot)){ if(is_regular_file(p.path())) files.push_back(p.path()); }
-    // compute checksums for manifest
-    string mani = joinp(c.state_dir, "manifests/"+r.name+"-"+r.version+".manifest"); ensure_dir(filesystem::path(mani).parent_path()); string manifest_txt;
-    for(auto &f: files){ string h = sha256_file(f); manifest_txt += f + " " + h + "\n"; }
-    dump(mani, manifest_txt);
-    // package binaries
-    if(do_pack){ ensure_dir(c.bin_dir); string pkgfile = joinp(c.bin_dir, r.name+"-"+r.version+".tar.zst"); string cmd = "tar -C '"+pkgroot+"' -I zstd -cpf '"+pkgfile+"' ."; run(cmd); }
-    // strip if requested
-    if(do_strip){ // naive: find ELF and call strip
-        for(auto &f: files){ // simple heuristic by extension
-            if(f.find("/bin/")!=string::npos || f.find("/sbin/")!=string::npos || f.find("/lib/")!=string::npos){ run("file '"+f+"' | grep ELF >/dev/null && strip --strip-all '"+f+"' || true"); }
+// under the shared jobserver "make -j${JOBS}" loses its -j: an explicit -jN makes GNU make leave the pool ("forced in submake").
+// Other uses of ${JOBS} (ninja, cargo, ...) keep the static share computed by the scheduler.
+static string drop_make_jobs(string s){
+    for(const char *f: {"-j${JOBS}", "-j ${JOBS}", "--jobs=${JOBS}"}){ size_t pos = 0, fl = strlen(f);
+        while((pos = s.find(f, pos))!=string::npos){ size_t b = s.find_last_of(";&|(\n", pos); b = b==string::npos?0:b+1; while(b<pos && isspace((unsigned char)s[b])) b++;
+            string w = s.substr(b, s.find_first_of(" \t", b)-b); // first word of this command
+            if(w!="make" && w!="gmake" && w!="$(MAKE)" && w!="${MAKE}" && w!="$MAKE"){ pos += fl; continue; }
+            size_t e = pos+fl; if(pos>0 && s[pos-1]==' ') pos--; s.erase(pos, e-pos); } }
+    return s; }
+// jobs = ${JOBS} for this build (dropped from make -j under the shared jobserver); makeflags = the jobserver, exported to make steps only; log = step output (parallel builds)
+// key = build cache key (build_key); force = ignore existing artifacts
+struct BuildOpts { bool strip=false; bool pack=true; bool force=false; int jobs=1; string makeflags; string log; string key; };
+
+static int build_one(const Recipe &r, const Config &c, const BuildOpts &o, InstalledInfo &info){ // returns 0 on success; info is recorded by the caller
+    string work = joinp(c.stage_dir, "work/"+r.name+"-"+r.version); // per-build work and DESTDIR dirs
+    string stage = joinp(c.stage_dir, r.name+"-"+r.version+"/destdir");
+    string srcdir = r.git.empty()?string():git_cache_dir(c, r.git);
+    string redirect = o.log.empty()?string():" >>'"+o.log+"' 2>&1";
+    run("rm -rf '"+work+"' '"+stage+"' && mkdir -p '"+work+"'"); if(!o.log.empty()) dump(o.log, "");
+    // build cache: artifact keyed by the content hash of everything that feeds the build
+    string artifact = joinp(c.bin_dir, r.name+"-"+r.version+"-"+o.key.substr(0,16)+".tar.zst");
+    bool hit = !o.force && !o.key.empty() && exists_file(artifact);
+    if(hit) bcache::hits++; else bcache::misses++;
+    if(hit){ errln(ansi::green()+"[cache] hit "+r.name+" "+o.key.substr(0,16)+ansi::reset()); ensure_dir(stage); trace::Span sp(r.name, "unpack");
+        if(run("tar -C '"+stage+"' -I zstd -xpf '"+artifact+"'")!=0) return 5; utimensat(AT_FDCWD, artifact.c_str(), nullptr, 0); } // mtime = last use (LRU)
+    if(!hit){
+        // download
+        if(!r.git.empty()){
+            errln(ansi::cyan()+"[download] git "+r.git+ansi::reset());
+            FileLock lock(git_lock_path(c, r.git)); { trace::Span sp(r.name, "download"); if(!filesystem::exists(joinp(srcdir,".git")) && git_fetch_incremental(r.git, srcdir)!=0) return 1; } // already updated by prefetch
+            // copy the checkout into work
+            trace::Span sp(r.name, "unpack"); run("cp -a '"+srcdir+"/.' '"+work+"/'");
+        } else if(!r.sources.empty()){
+            for(auto &u: r.sources){ string fname; { trace::Span sp(r.name, "download"); fname = fetch_source(c, u, r.sha256); } if(fname.empty()) return 2; // sha verified by the cache
+                // unpack
+                trace::Span sp(r.name, "unpack"); run("tar -C '"+work+"' -xf '"+fname+"' --strip-components=1"); }
+        }
+        // apply patches
+        if(!r.patches.empty()){ trace::Span sp(r.name, "patch");
+            for(auto &purl: r.patches){ string pfile = fetch_source(c, purl, ""); if(pfile.empty()) return 4; run("cd '"+work+"' && patch -p1 < '"+pfile+"'"); }
         }
+        // env
+        vector<pair<string,string>> envs = {{"STAGE", stage}, {"JOBS", to_string(o.jobs)}};
+        ensure_dir(envs[0].second);
+        // run steps
+        auto run_step = [&](const vector<string> &cmds, bool jobserver){ for(auto &cmm: cmds){ string cmdline = "cd '"+work+"' && "; if(jobserver && !o.makeflags.empty()) cmdline += "export MAKEFLAGS='"+o.makeflags+"' && "; // replace ${STAGE}, ${JOBS}
+                    string s = jobserver && !o.makeflags.empty() ? drop_make_jobs(cmm) : cmm; size_t pos; while((pos=s.find("${STAGE}"))!=string::npos) s.replace(pos,8,envs[0].second); while((pos=s.find("${JOBS}"))!=string::npos) s.replace(pos,7,envs[1].second); cmdline += redirect.empty()?s:"( "+s+" )"+redirect; int rc = run(cmdline); if(rc!=0) return rc; } return 0; };
+        if(!r.configure.empty()){ trace::Span sp(r.name, "configure"); if(run_step(r.configure, false)) return 10; }
+        if(!r.make_cmd.empty()){ trace::Span sp(r.name, "make"); if(run_step(r.make_cmd, true)) return 11; }
+        if(!r.tests.empty()){ trace::Span sp(r.name, "tests"); if(run_step(r.tests, false)) return 12; }
+        if(!r.install_cmd.empty()){ trace::Span sp(r.name, "install"); if(run_step(r.install_cmd, false)) return 13; }
     }
-    // record to installed.json
-    InstalledInfo info; info.version = r.version; info.installed_at = nowstamp(); info.manifest = mani; for(auto &f: files) info.files.push_back(f); info.source_hash = ""; // could be computed
-    installed[r.name] = info; save_installed(c, installed);
-    // copy from pkgroot to root? We don't apply here; apply is separate step
-    string staged_dest = joinp(c.stage_dir, r.name+"-"+r.version+"/pkgroot"); run("rm -rf '"+staged_dest+"' && mkdir -p '"+staged_dest+"' && cp -a '"+pkgroot+"/.' '"+staged_dest+"/'");
+    // strip (if requested), manifest and package in a single walk of the stage; cached artifacts are already stripped
+    string pkgroot = stage; // staged install path
+    string tmp = (o.pack && !hit) ? artifact+".tmp" : string(); if(!tmp.empty()){ error_code ec; filesystem::create_directories(c.bin_dir, ec); }
+    vector<ManifestEntry> entries; if(package_stage(pkgroot, tmp, o.strip && !hit, o.jobs, entries, r.name)!=0){ errln(ansi::red()+"packaging failed for "+r.name+ansi::reset()); return 14; }
+    if(!tmp.empty() && rename(tmp.c_str(), artifact.c_str())!=0) return 14;
+    // manifest: target path (relative to /), sha256, size and mtime for `lfsd verify`
+    trace::Span sp(r.name, "manifest"); string mani = joinp(c.state_dir, "manifests/"+r.name+"-"+r.version+".manifest"); ensure_dir(filesystem::path(mani).parent_path()); string manifest_txt; vector<string> targets;
+    for(auto &e: entries){ targets.push_back(e.path); manifest_txt += e.path + " " + e.sha256 + " " + to_string(e.size) + " " + to_string(e.mtime) + "\n"; }
+    dump(mani, manifest_txt);
+    // record to installed.db (done by the scheduler, serialized)
+    info = InstalledInfo(); info.version = r.version; info.installed_at = nowstamp(); info.manifest = mani; info.files = targets; info.source_hash = o.key;
+    // move the staged tree to pkgroot (same filesystem: a rename, no copy); apply is a separate step
+    string staged_dest = joinp(c.stage_dir, r.name+"-"+r.version+"/pkgroot"); error_code ec; filesystem::remove_all(staged_dest, ec);
+    if(rename(pkgroot.c_str(), staged_dest.c_str())!=0){ errln(ansi::red()+"cannot move "+pkgroot+" to "+staged_dest+": "+strerror(errno)+ansi::reset()); return 15; }
     return 0;
 }
 
-// ----------------- apply promoted stage to / (with snapshot tar backup) ----------------
-static int apply_stage(const Config &c){ // create snapshot tar of /usr (safe) then rsync
-    string label = "apply-"+nowstamp(); string snapdir = joinp(c.cache_dir, "snaps"); ensure_dir(snapdir);
-    string snapfile = joinp(snapdir, label+".tar.zst"); cerr<<ansi::yellow()<<"[snap] creating backup "<<snapfile<<ansi::reset()<<"\n";
-    int rc = run("tar -C / -I zstd -cpf '"+snapfile+"' usr || true"); if(rc!=0) return rc;
-    // rsync all staged pkgroots into /
-    for(auto &p: filesystem::directory_iterator(c.stage_dir)){
-        if(!p.is_directory()) continue;
-        string pkgroot = joinp(p.path(), "pkgroot"); if(!exists_file(pkgroot) && !filesystem::exists(pkgroot)) continue;
-        string cmd = "rsync -aHAX --delete '"+pkgroot+"/' /"; rc |= run(cmd);
+// ----------------- parallel build scheduler (DAG) ----------------
+// Keeps the graph instead of the flat order: every package whose deps have finished is started, up to max_builds at once.
+// The jobs budget is split: ${JOBS} becomes each build's share, and make steps use a shared jobserver.
+struct BuildResult { string name; int rc=0; double start=0, end=0; };
+
+static void print_build_summary(const vector<string> &order, const unordered_map<string, vector<string>> &deps, const unordered_map<string, BuildResult> &res, double wall){
+    // critical path: the dependency chain with the largest total duration
+    unordered_map<string,double> cp; unordered_map<string,string> via; string tail; double busy=0;
+    for(auto &n: order){ auto it=res.find(n); if(it==res.end()) continue; double d = it->second.end-it->second.start, best=0; busy += d;
+        for(auto &dep: deps.at(n)) if(cp.count(dep) && cp[dep]>best){ best=cp[dep]; via[n]=dep; }
+        cp[n]=best+d; if(tail.empty() || cp[n]>cp[tail]) tail=n; }
+    cerr<<ansi::bold()<<"[sched] "<<res.size()<<"/"<<order.size()<<" builds, wall "<<fixed<<setprecision(1)<<wall<<"s, build time "<<busy<<"s"<<ansi::reset()<<"\n";
+    if(tail.empty()) return;
+    vector<string> path; for(string n=tail; !n.empty(); n = via.count(n)?via[n]:string()) path.push_back(n); reverse(path.begin(), path.end());
+    cerr<<"[sched] critical path ("<<cp[tail]<<"s):"; for(auto &n: path){ auto &r = res.at(n); cerr<<" "<<n<<"("<<(r.end-r.start)<<"s)"; if(&n!=&path.back()) cerr<<" ->"; } cerr<<defaultfloat<<"\n";
+}
+
+// where the time went: the package's own steps versus what lfsd does around them
+static void print_phase_summary(){ static const vector<string> own = {"configure","make","tests","install"}, ours = {"download","unpack","patch","strip","manifest","pack"};
+    map<string,double> tot; { lock_guard<mutex> g(trace::mu); for(auto &e: trace::events) tot[e.phase] += e.dur; }
+    auto line = [&](const vector<string> &ph){ double sum=0; string parts; char b[64]; for(auto &p: ph) if(tot.count(p)){ sum += tot[p]; snprintf(b, sizeof(b), "%s%s %.1fs", parts.empty()?"":", ", p.c_str(), tot[p]); parts += b; }
+        snprintf(b, sizeof(b), "%.1fs", sum); return string(b)+(parts.empty()?string():" ("+parts+")"); };
+    errln(ansi::cyan()+"[trace] package steps "+line(own)+"; lfsd "+line(ours)+ansi::reset()); }
+
+// force = ignore the build cache; built (optional) = number of packages actually built or restaged
+static int build_graph(const vector<Recipe> &recs, const Config &c, unordered_map<string, InstalledInfo> &db, bool do_strip, bool do_pack, bool force=false, size_t *built=nullptr){
+    unordered_map<string, const Recipe*> byname; for(auto &r: recs) byname[r.name]=&r;
+    unordered_map<string, vector<string>> deps; for(auto &r: recs){ auto &d = deps[r.name]; for(auto &x: r.depends) if(byname.count(x)) d.push_back(x); } // deps outside the set are already installed
+    vector<string> order = topo_sort(deps);
+    unordered_map<string, vector<string>> rdeps; unordered_map<string,int> pending, height;
+    for(auto &kv: deps){ pending[kv.first]=kv.second.size(); for(auto &d: kv.second) rdeps[d].push_back(kv.first); }
+    for(auto it=order.rbegin(); it!=order.rend(); ++it){ int h=0; for(auto &v: rdeps[*it]) h=max(h,height[v]+1); height[*it]=h; } // long chains first
+    vector<vector<string>> inputs(order.size()); parallel_for(order.size(), c.fetch_jobs, [&](size_t i){ inputs[i] = source_inputs(c, *byname.at(order[i])); }); // network: git HEADs, patches
+    unordered_map<string,string> keys; for(size_t i=0;i<order.size();i++){ auto &n = order[i]; auto &r = *byname.at(n); vector<string> dk; vector<string> ds = r.depends; sort(ds.begin(), ds.end());
+        for(auto &d: ds) dk.push_back(keys.count(d)?keys[d]:(db.count(d)?db[d].source_hash:string("-"))); keys[n] = build_key(r, do_strip, dk, inputs[i]); }
+    long skipped=0; bcache::hits=0; bcache::misses=0;
+    auto uptodate = [&](const string &n){ return !force && db.count(n) && db[n].source_hash==keys[n] && db[n].version==byname.at(n)->version; };
+    { vector<const Recipe*> need; for(auto &n: order){ auto &r = *byname.at(n); if(uptodate(n) || (!force && exists_file(joinp(c.bin_dir, r.name+"-"+r.version+"-"+keys[n].substr(0,16)+".tar.zst")))) continue; need.push_back(&r); }
+      if(prefetch(c, need, c.fetch_jobs)!=0){ errln(ansi::red()+"fetch failed; nothing was built"+ansi::reset()); return 2; } }
+    int slots = max(1, min(c.max_builds, (int)order.size())); int share = max(1, c.jobs/slots);
+    // jobserver: every make already holds an implicit token, so the pipe gets jobs-slots tokens
+    int jfd[2]={-1,-1}; string makeflags;
+    if(slots>1 && pipe(jfd)==0){ string tok(max(0, c.jobs-slots), '+'); if(tok.empty() || write(jfd[1], tok.data(), tok.size())==(ssize_t)tok.size()) makeflags = "-j"+to_string(c.jobs)+" --jobserver-auth="+to_string(jfd[0])+","+to_string(jfd[1]); }
+    if(slots>1) ensure_dir(joinp(c.log_dir, "build"));
+    cerr<<ansi::cyan()<<"[sched] "<<order.size()<<" packages, "<<slots<<" concurrent builds, "<<c.jobs<<" jobs"<<ansi::reset()<<"\n";
+    mutex mu; condition_variable cv; deque<BuildResult> done; unordered_map<string, thread> workers; unordered_map<string, BuildResult> results;
+    vector<string> ready; for(auto &n: order) if(pending[n]==0) ready.push_back(n);
+    int running=0, first_rc=0; string failed; auto t0 = chrono::steady_clock::now();
+    // workers only update db/fresh; the scheduler saves outside mu at most every 30s and at the end, merging what was built into
+    // the current installed.db under its lock (another lfsd may have changed it since db was loaded)
+    bool dirty=false; double saved_at=0; unordered_map<string, InstalledInfo> fresh;
+    auto save_built = [&c](const unordered_map<string, InstalledInfo> &b){ DbLock dl(c); auto cur = load_installed(c); for(auto &kv: b) cur[kv.first]=kv.second; save_installed(c, cur); };
+    unique_lock<mutex> lk(mu);
+    while(true){
+        while(failed.empty() && running<slots && !ready.empty()){
+            auto best = max_element(ready.begin(), ready.end(), [&](const string &a, const string &b){ return height[a]<height[b]; }); string n=*best; ready.erase(best);
+            if(uptodate(n)){ skipped++; errln(ansi::green()+"[cache] up-to-date "+n+ansi::reset()); for(auto &v: rdeps[n]) if(--pending[v]==0) ready.push_back(v); continue; }
+            BuildOpts o; o.strip=do_strip; o.pack=do_pack; o.force=force; o.key=keys[n]; o.jobs = slots>1?share:c.jobs; o.makeflags=makeflags; if(slots>1) o.log = joinp(c.log_dir, "build/"+n+".log");
+            running++; errln(ansi::cyan()+"[sched] start "+n+" ("+to_string(running)+"/"+to_string(slots)+")"+ansi::reset());
+            double st = secs_since(t0);
+            workers[n] = thread([&, n, o, st]{ InstalledInfo info; int rc = build_one(*byname.at(n), c, o, info);
+                lock_guard<mutex> g(mu); if(rc==0){ db[n]=info; fresh[n]=info; dirty=true; }
+                done.push_back({n, rc, st, secs_since(t0)}); cv.notify_one(); });
+        }
+        if(running==0) break;
+        cv.wait(lk, [&]{ return !done.empty(); });
+        while(!done.empty()){ BuildResult r = done.front(); done.pop_front(); running--; workers[r.name].join(); workers.erase(r.name);
+            if(r.rc!=0){ errln(ansi::red()+"build failed for "+r.name+" rc="+to_string(r.rc)+(slots>1?" (log: "+joinp(c.log_dir, "build/"+r.name+".log")+")":string())+ansi::reset());
+                if(failed.empty()){ failed=r.name; first_rc=r.rc; if(running) errln(ansi::yellow()+"[sched] waiting for "+to_string(running)+" running builds"+ansi::reset()); } continue; }
+            results[r.name]=r; char dur[32]; snprintf(dur, sizeof(dur), "%.1fs", r.end-r.start); errln(ansi::green()+"[sched] done "+r.name+" ("+dur+")"+ansi::reset());
+            for(auto &v: rdeps[r.name]) if(--pending[v]==0) ready.push_back(v); }
+        if(dirty && running && secs_since(t0)-saved_at>=30){ auto snap = fresh; dirty=false; lk.unlock(); save_built(snap); lk.lock(); saved_at = secs_since(t0); } // checkpoint
     }
-    return rc;
+    lk.unlock();
+    if(dirty) save_built(fresh); // every worker has been joined; also reached when a build failed
+    if(jfd[0]>=0){ close(jfd[0]); close(jfd[1]); }
+    print_build_summary(order, deps, results, secs_since(t0)); print_phase_summary();
+    errln(ansi::cyan()+"[cache] "+to_string(bcache::hits)+" hits, "+to_string(bcache::misses)+" misses, "+to_string(skipped)+" up-to-date"+ansi::reset());
+    add_cache_stats(c, bcache::hits, bcache::misses, skipped); if(built) *built = results.size();
+    return first_rc;
 }
 
+// ----------------- transactional apply (manifest-driven, undo journal) ----------------
+// Only files whose hash differs are installed (hardlink/reflink/copy to a tmp next to the target, then rename over it).
+// Whatever is overwritten or removed goes to state_dir/txn/<id>/files, and each step is written to the journal before it is done,
+// so `lfsd rollback <id>` (or an interrupted transaction) undoes exactly that change.
+// Journal: "N\tpath" created, "R\tpath\tbackup" replaced, "X\tpath\tbackup" removed, "D\tpath" directory created, "P\tpkg" installed.db
+// entry changed (undo rebuilds it from applied/<pkg>.info); "C" committed, "U" undone.
+static string applied_manifest(const Config &c, const string &pkg){ return joinp(c.state_dir, "applied/"+pkg+".manifest"); } // what is actually on /
+static string applied_info(const Config &c, const string &pkg){ return joinp(c.state_dir, "applied/"+pkg+".info"); } // the matching installed.db entry
+static string format_applied_info(const InstalledInfo &i){ return "version="+i.version+"\ninstalled_at="+i.installed_at+"\nsource_hash="+i.source_hash+"\n"; }
+// installed.db entry for what the applied records say is on / (files and manifest come from the applied manifest)
+static bool load_applied_info(const Config &c, const string &pkg, InstalledInfo &info){ string s = slurp(applied_info(c, pkg)); if(s.empty()) return false; info = InstalledInfo(); stringstream ss(s); string l;
+    while(getline(ss, l)){ size_t eq = l.find('='); if(eq==string::npos) continue; string k = l.substr(0, eq), v = l.substr(eq+1); if(k=="version") info.version=v; else if(k=="installed_at") info.installed_at=v; else if(k=="source_hash") info.source_hash=v; }
+    info.manifest = applied_manifest(c, pkg); for(auto &e: load_manifest(info.manifest)) info.files.push_back(e.path); return !info.version.empty(); }
+
+// copy preserving mode, owner and mtime: reflink first, then copy_file_range, then read/write
+static bool copy_file(const string &src, const string &dst){ struct stat st; if(lstat(src.c_str(), &st)!=0) return false;
+    if(S_ISLNK(st.st_mode)){ char buf[PATH_MAX]; ssize_t k = readlink(src.c_str(), buf, sizeof(buf)); if(k<0) return false; buf[k]=0; return symlink(buf, dst.c_str())==0; }
+    int in = open(src.c_str(), O_RDONLY|O_CLOEXEC); if(in<0) return false; int out = open(dst.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, st.st_mode&07777); if(out<0){ close(in); return false; }
+    bool ok = true;
+    if(ioctl(out, FICLONE, in)!=0){ off_t left = st.st_size; while(left>0){ ssize_t n = copy_file_range(in, nullptr, out, nullptr, left, 0); if(n<=0){ if(n<0 && errno==EINTR) continue; break; } left -= n; }
+        if(left>0){ vector<char> buf(1<<20); lseek(in, st.st_size-left, SEEK_SET); lseek(out, st.st_size-left, SEEK_SET); ssize_t n;
+            while(left>0 && (n = read(in, buf.data(), buf.size()))>0){ if(write(out, buf.data(), n)!=n){ ok=false; break; } left -= n; } if(left>0) ok=false; } }
+    if(fchown(out, st.st_uid, st.st_gid)!=0 && geteuid()==0) ok=false; fchmod(out, st.st_mode&07777); // chown only works as root
+    struct timespec ts[2] = {st.st_atim, st.st_mtim}; futimens(out, ts); close(in); if(close(out)!=0) ok=false; if(!ok) unlink(dst.c_str()); return ok; }
+
+// same inode when possible (hardlink keeps mode/owner/mtime), a copy across filesystems
+static bool place_file(const string &src, const string &dst){ if(link(src.c_str(), dst.c_str())==0) return true; return (errno==EXDEV || errno==EPERM || errno==EMLINK) && copy_file(src, dst); }
+static bool move_file(const string &src, const string &dst){ if(rename(src.c_str(), dst.c_str())==0) return true; if(errno!=EXDEV || !copy_file(src, dst)) return false; unlink(src.c_str()); return true; }
+
+struct Txn { string dir; int fd=-1; int seq=0; set<string> dirs; // dirs: already existing or created in this transaction
+    bool rec(const string &line){ string l = line+"\n"; return write(fd, l.data(), l.size())==(ssize_t)l.size(); }
+    bool open_new(const Config &c){ dir = joinp(c.state_dir, "txn/"+nowstamp()); for(int i=1; filesystem::exists(dir); i++) dir = joinp(c.state_dir, "txn/"+nowstamp()+"."+to_string(i));
+        error_code ec; filesystem::create_directories(joinp(dir, "files"), ec); fd = open(joinp(dir, "journal").c_str(), O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644); return fd>=0; }
+    // backup of an existing path into the journal (a hardlink when on the same filesystem)
+    bool backup(const string &p, string &name){ name = to_string(seq++); string b = joinp(dir, "files/"+name); return place_file(p, b); }
+    bool mkdirs(const string &path, const string &src_root){ vector<string> miss; for(filesystem::path d = filesystem::path(path).parent_path(); !d.empty() && d!=d.root_path(); d = d.parent_path()){ if(dirs.count(d)) break; struct stat st; if(stat(d.c_str(), &st)==0){ dirs.insert(d); break; } miss.push_back(d); }
+        for(auto it=miss.rbegin(); it!=miss.rend(); ++it){ struct stat st; mode_t m = 0755; bool have = !src_root.empty() && stat((src_root+*it).c_str(), &st)==0; if(have) m = st.st_mode&07777;
+            if(!rec("D\t"+*it) || mkdir(it->c_str(), m)!=0) return false; if(have && lchown(it->c_str(), st.st_uid, st.st_gid)!=0 && geteuid()==0) return false; dirs.insert(*it); }
+        return true; }
+    // atomic per-file update: new content next to the target, then rename over it
+    bool install(const string &src, const string &dst, const string &src_root){ if(!mkdirs(dst, src_root)) return false; string tmp = dst+".lfsd-new"; unlink(tmp.c_str());
+        struct stat st; if(lstat(dst.c_str(), &st)==0){ string b; if(S_ISDIR(st.st_mode) || !backup(dst, b) || !rec("R\t"+dst+"\t"+b)) return false; } else if(!rec("N\t"+dst)) return false;
+        if(!place_file(src, tmp)) return false; if(rename(tmp.c_str(), dst.c_str())!=0){ unlink(tmp.c_str()); return false; } return true; }
+    bool remove(const string &p){ string b; if(!backup(p, b) || !rec("X\t"+p+"\t"+b)) return false; return unlink(p.c_str())==0; }
+    bool commit(){ bool ok = rec("C") && fsync(fd)==0; close(fd); fd=-1; return ok; }
+};
+
+static vector<vector<string>> read_journal(const string &dir){ vector<vector<string>> out; stringstream ss(slurp(joinp(dir, "journal"))); string line;
+    while(getline(ss, line)){ vector<string> f; size_t a=0, b; while((b = line.find('\t', a))!=string::npos){ f.push_back(line.substr(a, b-a)); a=b+1; } f.push_back(line.substr(a)); out.push_back(f); }
+    return out; }
+
+// replays the journal backwards; marks it "U" so it is not undone twice
+static int undo_txn(const Config &c, const string &dir){ DbLock lk(c); auto j = read_journal(dir); int errs=0;
+    for(auto it=j.rbegin(); it!=j.rend(); ++it){ auto &f = *it; if(f.empty()) continue;
+        if(f[0]=="N" && f.size()>1){ if(unlink(f[1].c_str())!=0 && errno!=ENOENT) errs++; }
+        else if((f[0]=="R" || f[0]=="X") && f.size()>2){ string b = joinp(dir, "files/"+f[2]); if(!exists_file(b) && !filesystem::is_symlink(b)) continue; // backup not made yet
+            string tmp = f[1]+".lfsd-new"; unlink(tmp.c_str()); if(!move_file(b, tmp) || rename(tmp.c_str(), f[1].c_str())!=0){ errln(ansi::red()+"[txn] cannot restore "+f[1]+": "+strerror(errno)+ansi::reset()); errs++; } }
+        else if(f[0]=="D" && f.size()>1){ rmdir(f[1].c_str()); } }
+    // "P\tpkg": the apply changed this package's installed.db entry; put back the one matching the restored applied records
+    set<string> touched; for(auto &f: j) if(f.size()>1 && f[0]=="P") touched.insert(f[1]);
+    if(!touched.empty()){ auto db = load_installed(c); for(auto &pkg: touched){ InstalledInfo info; if(load_applied_info(c, pkg, info)) db[pkg]=info;
+        else if(exists_file(applied_manifest(c, pkg)) && db.count(pkg)){ auto &d = db[pkg]; d.manifest = applied_manifest(c, pkg); d.files.clear(); for(auto &e: load_manifest(d.manifest)) d.files.push_back(e.path); d.source_hash.clear(); } // applied before .info existed: unknown key, forces a rebuild
+        else db.erase(pkg); } save_installed(c, db); }
+    int fd = open(joinp(dir, "journal").c_str(), O_WRONLY|O_APPEND|O_CLOEXEC); if(fd>=0){ if(write(fd, "U\n", 2)!=2) errs++; fsync(fd); close(fd); }
+    return errs?1:0; }
+
+static string txn_state(const string &dir){ auto j = read_journal(dir); for(auto it=j.rbegin(); it!=j.rend(); ++it){ if(it->size()==1 && ((*it)[0]=="C" || (*it)[0]=="U")) return (*it)[0]; } return "open"; }
+
+// interrupted transactions (crash, power loss) are undone before any new apply
+static void recover_txns(const Config &c){ error_code ec; for(auto &e: filesystem::directory_iterator(joinp(c.state_dir, "txn"), ec)){ if(!e.is_directory() || txn_state(e.path())!="open") continue;
+    errln(ansi::yellow()+"[txn] rolling back interrupted transaction "+e.path().filename().string()+ansi::reset()); undo_txn(c, e.path()); } }
+
+// retention: finished transactions (committed or rolled back) beyond the newest `keep` are deleted with their backups,
+// so the oldest can no longer be rolled back; interrupted ones are left to recover_txns()
+static int txn_gc(const Config &c, int keep, bool verbose){ string txdir = joinp(c.state_dir, "txn"); vector<string> done; error_code ec;
+    for(auto &e: filesystem::directory_iterator(txdir, ec)) if(e.is_directory() && txn_state(e.path())!="open") done.push_back(e.path().filename());
+    sort(done.begin(), done.end()); size_t drop = done.size()>(size_t)keep ? done.size()-keep : 0; uintmax_t freed=0;
+    for(size_t i=0;i<drop;i++){ string d = joinp(txdir, done[i]);
+        for(auto it = filesystem::recursive_directory_iterator(d, ec); !ec && it!=filesystem::recursive_directory_iterator(); it.increment(ec)){ struct stat st; if(lstat(it->path().c_str(), &st)==0 && S_ISREG(st.st_mode)) freed += st.st_size; }
+        ec.clear(); filesystem::remove_all(d, ec); }
+    if(verbose || drop) errln(ansi::cyan()+"[txn] removed "+to_string(drop)+" of "+to_string(done.size())+" finished transactions ("+to_string(freed>>20)+" MiB)"+ansi::reset());
+    return 0; }
+
+static int apply_stage(const Config &c){ auto t0 = chrono::steady_clock::now(); DbLock lk(c); recover_txns(c); auto db = load_installed(c);
+    struct Pkg { string name, stage, root; vector<ManifestEntry> now; unordered_map<string, ManifestEntry> before; };
+    vector<Pkg> pkgs; for(auto &kv: db){ string st = joinp(c.stage_dir, kv.first+"-"+kv.second.version); string root = joinp(st, "pkgroot"); if(!filesystem::is_directory(root)) continue;
+        Pkg p; p.name = kv.first; p.stage = st; p.root = root; p.now = load_manifest(kv.second.manifest); for(auto &e: load_manifest(applied_manifest(c, p.name))) p.before[e.path]=e; pkgs.push_back(move(p)); }
+    if(pkgs.empty()){ cout<<"nothing staged\n"; return 0; }
+    sort(pkgs.begin(), pkgs.end(), [](const Pkg &a, const Pkg &b){ return a.name<b.name; });
+    // decide in parallel (read-only): 0 keep, 1 install; stale paths: 2 remove, 3 keep (modified since install)
+    struct Op { Pkg *p; string path; const ManifestEntry *e; char act=0; }; vector<Op> ops;
+    // a path that left one package may have moved to another (staged now, or already installed): it is not stale then
+    unordered_set<string> shipped; for(auto &p: pkgs) for(auto &e: p.now) shipped.insert(e.path);
+    idb::View owners; open_installed(c, owners);
+    auto owned_elsewhere = [&](const string &path, const string &pkg){ if(shipped.count(path)) return true; auto o = owners.owner(path); return o && owners.str(o->name)!=pkg; };
+    for(auto &p: pkgs){ for(auto &e: p.now) ops.push_back({&p, e.path, &e});
+        for(auto &kv: p.before) if(!owned_elsewhere(kv.first, p.name)) ops.push_back({&p, kv.first, &kv.second, 2}); }
+    { trace::Span scan("*", "apply"); // comparing / against the manifests, all packages at once
+    parallel_for(ops.size(), c.jobs, [&](size_t i){ auto &o = ops[i]; struct stat st; bool there = lstat(o.path.c_str(), &st)==0;
+        if(o.act==2){ if(!there) o.act=0; else if(installed_hash(o.path)!=o.e->sha256) o.act=3; return; }
+        if(!there){ o.act=1; return; }
+        auto b = o.p->before.find(o.path); // unchanged since the last apply: size+mtime of the record avoid hashing
+        if(b!=o.p->before.end() && b->second.sha256==o.e->sha256 && b->second.size==(long long)st.st_size && b->second.mtime==(long long)st.st_mtime && !S_ISLNK(st.st_mode)) return;
+        o.act = installed_hash(o.path)==o.e->sha256 ? 0 : 1; }); }
+    Txn tx; if(!tx.open_new(c)){ errln(ansi::red()+"[txn] cannot create journal in "+joinp(c.state_dir, "txn")+ansi::reset()); return 1; }
+    size_t installed=0, removed=0, same=0; string failed; Pkg *cur=nullptr; double cur_t=0; // trace: one "apply" span per package (ops are grouped by package)
+    auto span_end = [&]{ if(cur) trace::add(cur->name, "apply", cur_t, secs_since(trace::t0)-cur_t); };
+    for(auto &o: ops){ bool ok = true; if(o.p!=cur){ span_end(); cur=o.p; cur_t=secs_since(trace::t0); }
+        if(o.act==1){ ok = tx.install(o.p->root+o.path, o.path, o.p->root); installed++; }
+        else if(o.act==2){ ok = tx.remove(o.path); removed++; }
+        else if(o.act==3) errln(ansi::yellow()+"keeping modified file "+o.path+" ("+o.p->name+")"+ansi::reset());
+        else same++;
+        if(!ok){ failed = o.path+": "+strerror(errno); break; } }
+    span_end();
+    // record what is now on / for the next apply (inside the transaction, so rollback restores it too)
+    if(failed.empty()){ ensure_dir(joinp(c.state_dir, "applied")); for(auto &p: pkgs){ string src = db[p.name].manifest, dst = applied_manifest(c, p.name), tmp = dst+".new", info = applied_info(c, p.name), itmp = info+".new";
+        unlink(tmp.c_str()); unlink(itmp.c_str());
+        if(!tx.rec("P\t"+p.name) || !copy_file(src, tmp) || !tx.install(tmp, dst, "") || !dump_atomic(itmp, format_applied_info(db[p.name])) || !tx.install(itmp, info, "")){ failed = dst+": "+strerror(errno); unlink(tmp.c_str()); unlink(itmp.c_str()); break; }
+        unlink(tmp.c_str()); unlink(itmp.c_str()); } }
+    if(!failed.empty()){ errln(ansi::red()+"[txn] apply failed at "+failed+"; rolling back"+ansi::reset()); close(tx.fd); undo_txn(c, tx.dir); return 1; }
+    if(!tx.commit()){ errln(ansi::red()+"[txn] cannot commit "+tx.dir+ansi::reset()); return 1; }
+    for(auto &p: pkgs){ error_code ec; filesystem::remove_all(p.stage, ec); } // stage consumed
+    txn_gc(c, c.txn_keep, false);
+    string id = filesystem::path(tx.dir).filename();
+    cout<<ansi::green()<<"applied "<<pkgs.size()<<" packages: "<<installed<<" files installed, "<<removed<<" removed, "<<same<<" unchanged in "<<fixed<<setprecision(1)<<secs_since(t0)<<"s"<<defaultfloat<<ansi::reset()<<"\n";
+    cout<<"transaction "<<id<<" (undo with `lfsd rollback "<<id<<"`)\n";
+    return 0; }
+
+// ----------------- snapshots (content-addressed store) ----------------
+// Each unique content goes once to snaps/objects/<aa>/<sha256>; a snapshot is only the tree (snaps/<name>.snap, zstd).
+// Hashes come from the package manifests and the previous snapshot when size+mtime match, so only what changed is read.
+namespace snap {
+struct Entry { char kind; unsigned mode=0; long uid=0, gid=0; long long mtime=0, size=0; string data, path; }; // kind: F file (data=sha256), L symlink (data=target), D dir
+
+static string dir(const Config &c){ return joinp(c.cache_dir, "snaps"); }
+static string object(const Config &c, const string &h){ return joinp(dir(c), "objects/"+h.substr(0,2)+"/"+h.substr(2)); }
+static string tree(const Config &c, const string &name){ return joinp(dir(c), name+".snap"); }
+
+static bool save(const string &path, const vector<Entry> &ents){ string tmp = path+".tmp"; FILE *f = popen(("zstd -q -f -o '"+tmp+"'").c_str(), "w"); if(!f) return false;
+    fprintf(f, "lfsd-snap 1\n"); char m[16];
+    for(auto &e: ents){ snprintf(m, sizeof(m), "%o", e.mode); fprintf(f, "%c\t%s\t%ld\t%ld\t%lld\t%lld\t%s\t%s\n", e.kind, m, e.uid, e.gid, e.mtime, e.size, e.data.c_str(), e.path.c_str()); }
+    if(pclose(f)!=0 || rename(tmp.c_str(), path.c_str())!=0){ unlink(tmp.c_str()); return false; } return true; }
+
+static bool load(const string &path, vector<Entry> &ents){ if(!exists_file(path)) return false; FILE *f = popen(("zstd -dc '"+path+"'").c_str(), "r"); if(!f) return false;
+    string line; char buf[8192]; bool first=true, ok=true;
+    while(fgets(buf, sizeof(buf), f)){ line += buf; if(line.back()!='\n') continue; line.pop_back();
+        if(first){ first=false; if(line!="lfsd-snap 1"){ ok=false; break; } line.clear(); continue; }
+        vector<string> fl; size_t a=0, b; for(int k=0;k<7 && (b = line.find('\t', a))!=string::npos;k++){ fl.push_back(line.substr(a, b-a)); a=b+1; } fl.push_back(line.substr(a)); line.clear();
+        if(fl.size()!=8 || fl[0].size()!=1){ ok=false; continue; }
+        Entry e; e.kind=fl[0][0]; e.mode=stoul(fl[1], nullptr, 8); e.uid=stol(fl[2]); e.gid=stol(fl[3]); e.mtime=stoll(fl[4]); e.size=stoll(fl[5]); e.data=fl[6]; e.path=fl[7]; ents.push_back(move(e)); }
+    return pclose(f)==0 && ok && !first; }
+
+static void walk(const string &p, vector<Entry> &out){ struct stat st; if(lstat(p.c_str(), &st)!=0) return;
+    Entry e; e.path=p; e.mode=st.st_mode&07777; e.uid=st.st_uid; e.gid=st.st_gid; e.mtime=st.st_mtime;
+    if(S_ISDIR(st.st_mode)){ e.kind='D'; out.push_back(e); vector<string> names; error_code ec; for(auto &d: filesystem::directory_iterator(p, ec)) names.push_back(d.path().filename()); sort(names.begin(), names.end());
+        for(auto &n: names) walk(joinp(p, n), out); return; }
+    if(S_ISLNK(st.st_mode)){ char buf[PATH_MAX]; ssize_t k = readlink(p.c_str(), buf, sizeof(buf)); if(k<0) return; e.kind='L'; e.data.assign(buf, k); e.size=k; out.push_back(e); return; }
+    if(S_ISREG(st.st_mode)){ e.kind='F'; e.size=st.st_size; out.push_back(e); } }
+
+// snapshot names, newest first
+static vector<pair<string,time_t>> list(const Config &c){ vector<pair<string,time_t>> out; error_code ec;
+    for(auto &e: filesystem::directory_iterator(dir(c), ec)){ string n = e.path().filename(); struct stat st; if(n.size()<6 || n.substr(n.size()-5)!=".snap" || stat(e.path().c_str(), &st)!=0) continue; out.push_back({n.substr(0, n.size()-5), st.st_mtime}); }
+    sort(out.begin(), out.end(), [](auto &a, auto &b){ return a.second!=b.second ? a.second>b.second : a.first>b.first; }); return out; }
+}
+
+static int cmd_snapshot(const Config &c, const string &label, vector<string> roots){ auto t0 = chrono::steady_clock::now(); if(roots.empty()) roots = {"/usr"}; ensure_dir(snap::dir(c));
+    if(c.snapshot_backend=="tar"){ string out = joinp(snap::dir(c), label+".tar.zst"), paths; for(auto &r: roots) paths += " '"+r.substr(r[0]=='/')+"'";
+        int rc = run("tar -C / -I zstd -cpf '"+out+"'"+paths); if(rc==0) cout<<"snapshot "<<out<<" created\n"; return rc; }
+    if(c.snapshot_backend!="cas"){ cerr<<ansi::red()<<"unknown snapshot_backend "<<c.snapshot_backend<<" (cas, tar)"<<ansi::reset()<<"\n"; return 1; }
+    if(exists_file(snap::tree(c, label))){ cerr<<"snapshot "<<label<<" already exists\n"; return 1; }
+    vector<snap::Entry> ents; for(auto &r: roots) snap::walk(filesystem::path(r).lexically_normal().string(), ents);
+    // known hashes: package manifests, then the newest snapshot (it also covers files no package owns)
+    unordered_map<string, ManifestEntry> known; { auto db = load_installed(c); for(auto &kv: db) for(auto &e: load_manifest(kv.second.manifest)) known[e.path]=e; }
+    auto prev = snap::list(c); if(!prev.empty()){ vector<snap::Entry> pe; snap::load(snap::tree(c, prev[0].first), pe); for(auto &e: pe) if(e.kind=='F'){ ManifestEntry m; m.path=e.path; m.sha256=e.data; m.size=e.size; m.mtime=e.mtime; known[e.path]=m; } }
+    vector<size_t> todo; for(size_t i=0;i<ents.size();i++){ auto &e = ents[i]; if(e.kind!='F') continue; auto k = known.find(e.path);
+        if(k!=known.end() && k->second.size==e.size && k->second.mtime==e.mtime && k->second.sha256.size()==64) e.data = k->second.sha256; else todo.push_back(i); }
+    parallel_for(todo.size(), c.jobs, [&](size_t i){ ents[todo[i]].data = sha256_file(ents[todo[i]].path); });
+    // store new blobs (reflink/copy; never hardlinks, a file edited in place would corrupt the store); objects are 0444,
+    // an old setuid binary must not stay runnable from the cache (restore applies the recorded mode)
+    vector<size_t> files; unordered_set<string> seen; for(size_t i=0;i<ents.size();i++){ auto &e = ents[i]; if(e.kind=='F' && !e.data.empty() && seen.insert(e.data).second) files.push_back(i); }
+    atomic<size_t> stored{0}; atomic<long long> bytes{0}; atomic<int> errs{0};
+    parallel_for(files.size(), c.jobs, [&](size_t i){ auto &e = ents[files[i]]; string obj = snap::object(c, e.data); if(exists_file(obj)) return;
+        error_code ec; filesystem::create_directories(filesystem::path(obj).parent_path(), ec); string tmp = obj+".tmp."+to_string(i); unlink(tmp.c_str());
+        if(!copy_file(e.path, tmp) || chmod(tmp.c_str(), 0444)!=0 || sha256_file(tmp)!=e.data || rename(tmp.c_str(), obj.c_str())!=0){ unlink(tmp.c_str()); errs++; errln(ansi::red()+"[snap] cannot store "+e.path+ansi::reset()); return; }
+        stored++; bytes += e.size; });
+    ents.erase(remove_if(ents.begin(), ents.end(), [](const snap::Entry &e){ return e.kind=='F' && e.data.empty(); }), ents.end()); // vanished or unreadable
+    if(errs || !snap::save(snap::tree(c, label), ents)){ cerr<<ansi::red()<<"snapshot "<<label<<" failed"<<ansi::reset()<<"\n"; return 1; }
+    cout<<ansi::green()<<"snapshot "<<label<<": "<<ents.size()<<" entries, "<<todo.size()<<" hashed, "<<stored<<" new objects ("<<bytes/1048576<<" MiB) in "<<fixed<<setprecision(1)<<secs_since(t0)<<"s"<<defaultfloat<<ansi::reset()<<"\n";
+    return 0; }
+
+// restores `paths` (everything when empty) from a snapshot as an apply transaction, so it can be undone too
+static int snapshot_restore(const Config &c, const string &name, const vector<string> &paths){ auto t0 = chrono::steady_clock::now(); vector<snap::Entry> ents;
+    if(!snap::load(snap::tree(c, name), ents)){ cerr<<"cannot read snapshot "<<name<<"\n"; return 1; }
+    auto wanted = [&](const string &p){ if(paths.empty()) return true; for(auto &q: paths){ string n = filesystem::path(q).lexically_normal().string(); if(!n.empty() && n.back()=='/') n.pop_back(); if(p==n || (p.size()>n.size() && p.compare(0, n.size(), n)==0 && p[n.size()]=='/')) return true; } return false; };
+    vector<snap::Entry*> sel; for(auto &e: ents) if(e.kind!='D' && wanted(e.path)) sel.push_back(&e);
+    if(sel.empty()){ cerr<<"nothing in "<<name<<" matches\n"; return 1; }
+    vector<char> need(sel.size(), 0);
+    parallel_for(sel.size(), c.jobs, [&](size_t i){ auto &e = *sel[i]; struct stat st; if(lstat(e.path.c_str(), &st)!=0){ need[i]=1; return; }
+        if(e.kind=='L'){ need[i] = !S_ISLNK(st.st_mode) || installed_hash(e.path)!=hex_of(e.data); return; }
+        if(!S_ISREG(st.st_mode)){ need[i]=1; return; }
+        if(st.st_size==e.size && st.st_mtime==e.mtime && (st.st_mode&07777)==e.mode) return; need[i] = st.st_size!=e.size || sha256_file(e.path)!=e.data || (st.st_mode&07777)!=e.mode; });
+    recover_txns(c); Txn tx; if(!tx.open_new(c)){ cerr<<"cannot create journal\n"; return 1; }
+    string tmpdir = joinp(snap::dir(c), "tmp"); error_code ec; filesystem::create_directories(tmpdir, ec); size_t restored=0; string failed;
+    for(size_t i=0;i<sel.size() && failed.empty();i++){ if(!need[i]) continue; auto &e = *sel[i]; string tmp = joinp(tmpdir, to_string(i)); unlink(tmp.c_str());
+        bool ok = e.kind=='L' ? symlink(e.data.c_str(), tmp.c_str())==0 : copy_file(snap::object(c, e.data), tmp);
+        if(ok && lchown(tmp.c_str(), e.uid, e.gid)!=0 && geteuid()==0) ok=false; // before chmod: chown clears setuid/setgid
+        if(ok && e.kind=='F'){ chmod(tmp.c_str(), e.mode); struct timespec ts[2] = {{0, UTIME_OMIT}, {(time_t)e.mtime, 0}}; utimensat(AT_FDCWD, tmp.c_str(), ts, 0); }
+        if(!ok || !tx.install(tmp, e.path, "")) failed = e.path+": "+strerror(errno); else restored++;
+        unlink(tmp.c_str()); }
+    if(!failed.empty()){ errln(ansi::red()+"[snap] restore failed at "+failed+"; rolling back"+ansi::reset()); close(tx.fd); undo_txn(c, tx.dir); return 1; }
+    if(!tx.commit()) return 1; string id = filesystem::path(tx.dir).filename(); txn_gc(c, c.txn_keep, false);
+    cout<<ansi::green()<<"restored "<<restored<<" of "<<sel.size()<<" paths from "<<name<<" in "<<fixed<<setprecision(1)<<secs_since(t0)<<"s"<<defaultfloat<<ansi::reset()<<"\n"<<"transaction "<<id<<" (undo with `lfsd rollback "<<id<<"`)\n";
+    return 0; }
+
+static int snapshot_list(const Config &c){ for(auto &s: snap::list(c)){ char t[64]; strftime(t, sizeof(t), "%Y-%m-%d %H:%M:%S", localtime(&s.second)); cout<<s.first<<"\t"<<t<<"\n"; } return 0; }
+
+// retention: the newest `keep` snapshots and those younger than `keep_days` stay; objects nothing references are swept
+static int snapshot_gc(const Config &c, int keep, int keep_days){ auto all = snap::list(c); time_t now = time(nullptr); vector<string> kept; size_t dropped=0;
+    for(size_t i=0;i<all.size();i++){ if((int)i<keep || (keep_days>0 && now-all[i].second < (time_t)keep_days*86400)) kept.push_back(all[i].first); else { unlink(snap::tree(c, all[i].first).c_str()); dropped++; } }
+    unordered_set<string> live; for(auto &n: kept){ vector<snap::Entry> ents; if(!snap::load(snap::tree(c, n), ents)){ cerr<<ansi::red()<<"cannot read snapshot "<<n<<"; not sweeping objects"<<ansi::reset()<<"\n"; return 1; }
+        for(auto &e: ents) if(e.kind=='F') live.insert(e.data); }
+    size_t swept=0; long long freed=0; error_code ec;
+    for(auto &d: filesystem::directory_iterator(joinp(snap::dir(c), "objects"), ec)) for(auto &o: filesystem::directory_iterator(d.path(), ec)){
+        string h = d.path().filename().string()+o.path().filename().string();
+        if(live.count(h)){ struct stat st; if(lstat(o.path().c_str(), &st)==0 && (st.st_mode&07777)!=0444) chmod(o.path().c_str(), 0444); continue; } // objects stored before they were made 0444
+        struct stat st; if(stat(o.path().c_str(), &st)==0) freed += st.st_size; unlink(o.path().c_str()); swept++; }
+    cout<<"snapshots: "<<kept.size()<<" kept, "<<dropped<<" removed; objects: "<<swept<<" removed ("<<freed/1048576<<" MiB)\n"; return 0; }
+
+// tar export of a stored snapshot (the tar backend's format)
+static int snapshot_export(const Config &c, const string &name, const string &out){ vector<snap::Entry> ents; if(!snap::load(snap::tree(c, name), ents)){ cerr<<"cannot read snapshot "<<name<<"\n"; return 1; }
+    string tmp = out+".tmp"; TarWriter tw; tw.f = popen(("zstd -q -f -T"+to_string(c.jobs)+" -o '"+tmp+"'").c_str(), "w"); if(!tw.f) return 1; vector<char> buf(1<<20);
+    for(auto &e: ents){ struct stat st{}; st.st_mode=e.mode; st.st_uid=e.uid; st.st_gid=e.gid; st.st_mtime=e.mtime; string n = "."+e.path;
+        if(e.kind=='D'){ tw.header(n+"/", st, '5', 0, ""); continue; } if(e.kind=='L'){ tw.header(n, st, '2', 0, e.data); continue; }
+        int fd = open(snap::object(c, e.data).c_str(), O_RDONLY|O_CLOEXEC); if(fd<0){ tw.ok=false; break; } tw.header(n, st, '0', e.size, ""); long long left = e.size; ssize_t k;
+        while(left>0 && (k = read(fd, buf.data(), min<long long>(buf.size(), left)))>0){ tw.put(buf.data(), k); left -= k; } close(fd); if(left) { tw.ok=false; break; } tw.pad(); }
+    tw.finish(); if(pclose(tw.f)!=0 || !tw.ok || rename(tmp.c_str(), out.c_str())!=0){ unlink(tmp.c_str()); cerr<<ansi::red()<<"export failed"<<ansi::reset()<<"\n"; return 1; }
+    cout<<"snapshot "<<name<<" exported to "<<out<<"\n"; return 0; }
+
+// rollback <txn>: undoes an apply (default: the last one); a snapshot name restores it (only `paths`, if given)
+static int cmd_rollback(const Config &c, const string &name, const vector<string> &paths){ string txdir = joinp(c.state_dir, "txn"); vector<string> committed; error_code ec;
+    for(auto &e: filesystem::directory_iterator(txdir, ec)) if(e.is_directory() && txn_state(e.path())=="C") committed.push_back(e.path().filename()); sort(committed.begin(), committed.end());
+    string id = name.empty() ? (committed.empty()?string():committed.back()) : name;
+    if(id.empty()){ cerr<<"no transaction to roll back\n"; return 1; }
+    if(filesystem::is_directory(joinp(txdir, id))){ string st = txn_state(joinp(txdir, id)); if(st=="U"){ cerr<<"transaction "<<id<<" was already rolled back\n"; return 1; }
+        for(auto &n: committed) if(n>id){ cerr<<ansi::red()<<"transaction "<<n<<" is newer; roll it back first"<<ansi::reset()<<"\n"; return 1; }
+        int rc = undo_txn(c, joinp(txdir, id)); cout<<(rc?ansi::red():ansi::green())<<"transaction "<<id<<(rc?" partially rolled back":" rolled back")<<ansi::reset()<<"\n"; return rc; }
+    if(exists_file(snap::tree(c, id))) return snapshot_restore(c, id, paths);
+    string path = joinp(snap::dir(c), id); if(!exists_file(path)) path += ".tar.zst"; if(!exists_file(path)) { cerr<<"no transaction or snapshot named "<<id<<"\n"; return 1; }
+    string sel; for(auto &p: paths) sel += " '"+p.substr(p[0]=='/')+"'"; run("tar -C / -I zstd -xpf '"+path+"'"+sel); cout<<"rollback applied\n"; return 0; }
+
 // ----------------- remove package ----------------
-static int remove_package(const string &pkg, const Config &c){ auto db = load_installed(c); if(!db.count(pkg)){ cerr<<ansi::red()<<"not installed\n"<<ansi::reset(); return 1; }
+static int remove_package(const string &pkg, const Config &c){ DbLock lk(c); auto db = load_installed(c); if(!db.count(pkg)){ cerr<<ansi::red()<<"not installed\n"<<ansi::reset(); return 1; }
     // check reverse deps: naive scan recipes and installed
-    auto recs = find_recipes(c.recipes_dir);
-    unordered_map<string, vector<string>> deps; for(auto &kv: recs){ Recipe rr = load_recipe_toml(kv.second); deps[rr.name]=rr.depends; }
-    for(auto &kv: db){ if(kv.first==pkg) continue; for(auto &d: deps[kv.first]) if(d==pkg){ cerr<<ansi::red()<<"package "<<kv.first<<" depends on "<<pkg<<"; remove aborted"<<ansi::reset()<<"\n"; return 2; } }
-    auto info = db[pkg]; // remove files
-    for(auto &f: info.files){ if(exists_file(f)){ string h = sha256_file(f); // best-effort check; skip if mismatch
-            run("rm -f '"+f+"'"); }
-    }
-    db.erase(pkg); save_installed(c, db);
+    auto &idx = recipe_index(c); auto rd = idx.rdeps.find(pkg);
+    if(rd!=idx.rdeps.end()) for(auto &user: rd->second) if(db.count(user)){ cerr<<ansi::red()<<"package "<<user<<" depends on "<<pkg<<"; remove aborted"<<ansi::reset()<<"\n"; return 2; }
+    auto info = db[pkg]; // remove files; best-effort check: keep files modified since install
+    unordered_map<string,string> recorded; for(auto &e: load_manifest(info.manifest)) recorded[e.path]=e.sha256;
+    vector<string> hashes(info.files.size()); parallel_for(info.files.size(), c.jobs, [&](size_t i){ hashes[i] = installed_hash(info.files[i]); });
+    for(size_t i=0;i<info.files.size();i++){ auto &f = info.files[i]; if(hashes[i].empty()) continue;
+        if(recorded.count(f) && recorded[f]!=hashes[i]){ cerr<<ansi::yellow()<<"keeping modified file "<<f<<ansi::reset()<<"\n"; continue; }
+        if(unlink(f.c_str())!=0) cerr<<ansi::red()<<"rm "<<f<<": "<<strerror(errno)<<ansi::reset()<<"\n"; }
+    db.erase(pkg); save_installed(c, db); unlink(applied_manifest(c, pkg).c_str()); unlink(applied_info(c, pkg).c_str());
     // log
     dump(joinp(c.log_dir, nowstamp()+"-remove-"+pkg+".log"), string("removed ")+pkg);
     return 0;
 }
 
+// ----------------- verify installed files against manifests ----------------
+// Files whose size+mtime match the manifest are accepted without hashing (fast enough for boot); --full forces the hash.
+static int cmd_verify(const Config &c, const vector<string> &pkgs, bool full){ auto t0 = chrono::steady_clock::now(); auto db = load_installed(c);
+    vector<ManifestEntry> all; vector<string> owner; int problems=0;
+    for(auto &kv: db){ if(!pkgs.empty() && find(pkgs.begin(), pkgs.end(), kv.first)==pkgs.end()) continue;
+        // what apply put in / (db's manifest is the last build's, which may not be applied yet); db only for pre-journal installs
+        string mp = applied_manifest(c, kv.first); if(!exists_file(mp)) mp = kv.second.manifest;
+        if(!exists_file(mp)){ cout<<ansi::red()<<"NOMANIFEST "<<kv.first<<ansi::reset()<<"\n"; problems++; continue; }
+        for(auto &e: load_manifest(mp)){ all.push_back(e); owner.push_back(kv.first); } }
+    vector<char> status(all.size(), 0); atomic<size_t> hashed{0}; // 0 ok, 1 missing, 2 modified
+    parallel_for(all.size(), c.jobs, [&](size_t i){ auto &e = all[i]; struct stat st; if(lstat(e.path.c_str(), &st)!=0){ status[i]=1; return; }
+        if(S_ISLNK(st.st_mode)){ if(installed_hash(e.path)!=e.sha256) status[i]=2; return; } // symlinks: hash of the target string
+        if(!full && e.size>=0){ if(st.st_size!=e.size){ status[i]=2; return; } if(st.st_mtime==e.mtime) return; }
+        hashed++; if(sha256_file(e.path)!=e.sha256) status[i]=2; });
+    for(size_t i=0;i<all.size();i++){ if(!status[i]) continue; problems++; cout<<ansi::red()<<(status[i]==1?"MISSING  ":"MODIFIED ")<<all[i].path<<ansi::reset()<<" ("<<owner[i]<<")\n"; }
+    cout<<(problems?ansi::red():ansi::green())<<"verified "<<all.size()<<" files ("<<hashed<<" hashed) in "<<(long)(secs_since(t0)*1000)<<" ms: "<<problems<<" problems"<<ansi::reset()<<"\n";
+    return problems?1:0; }
+
 // ----------------- list and info ----------------
-static int cmd_list(const Config &c){ auto recs = find_recipes(c.recipes_dir); auto db = load_installed(c);
-    vector<string> names; for(auto &kv: recs) names.push_back(kv.first); sort(names.begin(), names.end()); for(auto &n: names){ bool ok = db.count(n); cout<< (ok?"[\u2713] ":"[ ] ") << n; if(ok) cout<<" "<<db[n].version; cout<<"\n"; } return 0; }
-static int cmd_info(const string &pkg, const Config &c){ auto recs = find_recipes(c.recipes_dir); auto db = load_installed(c); if(!recs.count(pkg)){ cerr<<"recipe not found\n"; return 1; } Recipe r = load_recipe_toml(recs[pkg]); cout<<ansi::bold()<<pkg<<"@"<<r.version<<ansi::reset()<<"\n"; cout<<"depends: "; for(auto &d:r.depends) cout<<d<<" "; cout<<"\n"; if(db.count(pkg)){ cout<<ansi::green()<<"installed at "<<db[pkg].installed_at<<ansi::reset()<<"\n"; } else cout<<ansi::yellow()<<"not installed"<<ansi::reset()<<"\n"; return 0; }
+// queries take the index and db explicitly: the daemon answers them from memory, on the connection thread
+static int cmd_list(const RecipeIndex &idx, const idb::View &db, ostream &out){ auto &recs = idx.recipes;
+    vector<string> names; for(auto &kv: recs) names.push_back(kv.first); sort(names.begin(), names.end()); for(auto &n: names){ auto p = db.find(n); out<< (p?"[\u2713] ":"[ ] ") << n; if(p) out<<" "<<db.str(p->version); out<<"\n"; } return 0; }
+static int cmd_info(const string &pkg, const RecipeIndex &idx, const idb::View &db, ostream &out, ostream &err){ auto &recs = idx.recipes; if(!recs.count(pkg)){ err<<"recipe not found\n"; return 1; } const Recipe &r = recs.at(pkg); out<<ansi::bold()<<pkg<<"@"<<r.version<<ansi::reset()<<"\n"; out<<"depends: "; for(auto &d:r.depends) out<<d<<" "; out<<"\n"; if(auto p = db.find(pkg)){ out<<ansi::green()<<"installed "<<db.str(p->version)<<" at "<<db.str(p->installed_at)<<" ("<<p->files_count<<" files)"<<ansi::reset()<<"\n"; } else out<<ansi::yellow()<<"not installed"<<ansi::reset()<<"\n"; return 0; }
+static int cmd_owner(const vector<string> &paths, const idb::View &db, ostream &out, ostream &err){ int rc=0;
+    for(auto &p: paths){ string abs = p.empty()||p[0]!='/' ? filesystem::absolute(p).lexically_normal().string() : p; if(auto pk = db.owner(abs)) out<<abs<<" is owned by "<<db.str(pk->name)<<" "<<db.str(pk->version)<<"\n"; else { err<<abs<<" is not owned by any package\n"; rc=1; } }
+    return rc; }
+
+// ----------------- db import/export (installed.json <-> installed.db) ----------------
+static int cmd_db(const string &sub, const string &file, const Config &c){ string json = file.empty()?installed_json_path(c):file;
+    if(sub=="import"){ if(!exists_file(json)){ cerr<<json<<" not found\n"; return 1; } DbLock lk(c); auto db = load_installed_json(json); save_installed(c, db); cout<<"imported "<<db.size()<<" packages from "<<json<<"\n"; return 0; }
+    if(sub=="export"){ auto db = load_installed(c); if(!save_installed_json(json, db)){ cerr<<"cannot write "<<json<<"\n"; return 1; } cout<<"exported "<<db.size()<<" packages to "<<json<<"\n"; return 0; }
+    cerr<<"uso: lfsd db import|export [installed.json]\n"; return 1; }
 
 // ----------------- sync (git) ----------------
-static int cmd_sync(const Config &c, const string &repo=""){ string target = repo.empty()?c.recipes_dir:repo; if(filesystem::exists(joinp(target,".git"))){ return run("git -C '"+target+"' pull --ff-only"); } else if(!c.remote_url.empty()){ return run("git clone --branch '"+c.channel+"' '"+c.remote_url+"' '"+c.recipes_dir+"'"); } else { cerr<<"no remote and target is not a git repo\n"; return 1; } }
+static string git_head(const string &dir){ return trim(caprun("git -C '"+dir+"' rev-parse HEAD 2>/dev/null")); }
+static int cmd_sync(const Config &c, const string &repo=""){ string target = repo.empty()?c.recipes_dir:repo; int rc; string before = git_head(c.recipes_dir);
+    if(filesystem::exists(joinp(target,".git"))){ rc = run("git -C '"+target+"' pull --ff-only"); } else if(!c.remote_url.empty()){ rc = run("git clone --branch '"+c.channel+"' '"+c.remote_url+"' '"+c.recipes_dir+"'"); } else { cerr<<"no remote and target is not a git repo\n"; return 1; }
+    if(rc==0 && git_head(c.recipes_dir)!=before) recipe_index_ptr(c, true); // HEAD moved: refresh the index now so the next command starts warm
+    return rc; }
 
 // ----------------- upgrade installed ----------------
-static int cmd_upgrade(const Config &c){ auto recs = find_recipes(c.recipes_dir); auto db = load_installed(c); vector<string> to_upgrade;
-    for(auto &kv: db){ string name = kv.first; if(recs.count(name)){ Recipe rr = load_recipe_toml(recs[name]); if(rr.version!=kv.second.version) to_upgrade.push_back(name); } }
-    if(to_upgrade.empty()){ cout<<"all up-to-date\n"; return 0; }
-    // plan build -> similar to install
-    for(auto &n: to_upgrade){ cout<<"upgrading "<<n<<"\n"; // naive: rebuild and apply
-        Recipe r = load_recipe_toml(recs[n]); unordered_map<string, InstalledInfo> inst = db; build_one(r,c,inst,c.stage_dir,false,true); }
-    apply_stage(c); return 0; }
+static int cmd_upgrade(const Config &c){ auto &recs = recipe_index(c).recipes; auto db = load_installed(c);
+    // every installed package goes through the graph: build_graph() skips those whose build key is unchanged
+    vector<Recipe> rs; for(auto &kv: db){ if(recs.count(kv.first)) rs.push_back(recs.at(kv.first)); }
+    size_t built=0; int rc = build_graph(rs,c,db,false,true,false,&built); if(rc!=0) return rc;
+    if(!built){ cout<<"all up-to-date\n"; return 0; }
+    return apply_stage(c); }
 
 // ----------------- rebuild and rebuild-all ----------------
-static int cmd_rebuild(const string &pkg, const Config &c){ auto recs = find_recipes(c.recipes_dir); if(!recs.count(pkg)){ cerr<<"recipe not found\n"; return 1; } Recipe r = load_recipe_toml(recs[pkg]); auto db = load_installed(c); return build_one(r,c,db,c.stage_dir,false,true); }
-static int cmd_rebuild_all(const Config &c){ auto recs = find_recipes(c.recipes_dir); unordered_map<string, vector<string>> deps; for(auto &kv: recs){ Recipe r = load_recipe_toml(kv.second); deps[r.name]=r.depends; }
-    vector<string> order = topo_sort(deps); auto db = load_installed(c); for(auto &n: order){ Recipe r = load_recipe_toml(recs[n]); build_one(r,c,db,c.stage_dir,false,true); }
-    return 0; }
+static int cmd_rebuild(const string &pkg, const Config &c){ auto &recs = recipe_index(c).recipes; if(!recs.count(pkg)){ cerr<<"recipe not found\n"; return 1; } Recipe r = recs.at(pkg); auto db = load_installed(c); return build_graph({r},c,db,false,true,true); }
+static int cmd_rebuild_all(const Config &c, bool force){ auto &recs = recipe_index(c).recipes; vector<Recipe> rs; for(auto &kv: recs) rs.push_back(kv.second);
+    auto db = load_installed(c); return build_graph(rs,c,db,false,true,force); }
 
-// ----------------- main CLI ----------------
-int main(int argc, char** argv){ ios::sync_with_stdio(false); cin.tie(nullptr);
-    Config cfg = load_config(); ansi::init(cfg.color);
-    if(argc<2){ cerr<<"uso: lfsd <cmd> [args]\n"; return 1; }
-    string cmd = argv[1]; // expand abbreviations
+// ----------------- plan/build helpers (shared by the CLI and the daemon) ----------------
+// targets and their deps (recursively), in build order
+static int plan_targets(const RecipeIndex &idx, const vector<string> &targets, vector<string> &order){ auto &recs = idx.recipes; unordered_map<string, vector<string>> deps;
+    for(auto &t: targets){ if(!recs.count(t)) { cerr<<"recipe "<<t<<" not found\n"; return 1; } // simple: include only the requested pkgs and their deps recursively
+        queue<string> q; q.push(t); unordered_set<string> seen;
+        while(!q.empty()){ auto u=q.front(); q.pop(); if(seen.count(u)) continue; seen.insert(u); if(!recs.count(u)) continue; const Recipe &rr = recs.at(u); deps[rr.name]=rr.depends; for(auto &d: rr.depends) q.push(d); } }
+    order = topo_sort(deps); return 0; }
+
+static int build_order(Config cfg, const vector<string> &order, const vector<string> &flags){ auto &recs = recipe_index(cfg).recipes; auto db = load_installed(cfg);
+    bool do_strip=false; bool do_pack=true;
+    for(size_t i=0;i<flags.size();i++){ if(flags[i]=="--strip") do_strip=true; if(flags[i]=="--no-pack") do_pack=false; if(flags[i]=="--parallel" && i+1<flags.size()) cfg.max_builds=max(1, atoi(flags[++i].c_str())); }
+    vector<Recipe> rs; for(auto &n: order){ if(!recs.count(n)){ cerr<<"recipe "<<n<<" not found\n"; return 1; } rs.push_back(recs.at(n)); }
+    int rc = build_graph(rs,cfg,db,do_strip,do_pack); if(rc!=0) return rc;
+    cout<<ansi::green()<<"builds completed\n"<<ansi::reset(); return 0; }
+
+static bool read_plan(const Config &cfg, vector<string> &order){ string planfile = joinp(cfg.state_dir, "pending.plan"); if(!exists_file(planfile)){ cerr<<"no plan. run plan first\n"; return false; }
+    stringstream ss(slurp(planfile)); string l; while(getline(ss,l)){ l=trim(l); if(!l.empty()) order.push_back(l); } return true; }
+
+// ----------------- command dispatch ----------------
+// a[0] is the command; runs in-process (CLI without daemon, or a daemon job)
+static int dispatch(Config cfg, const vector<string> &a){
+    string cmd = a[0]; // expand abbreviations
     if(cmd=="s") cmd="sync"; if(cmd=="p") cmd="plan"; if(cmd=="b") cmd="build"; if(cmd=="i") cmd="install"; if(cmd=="rm") cmd="remove";
-    if(cmd=="sync"){ string repo=""; if(argc>2) repo=argv[2]; return cmd_sync(cfg, repo); }
-    if(cmd=="list"){ return cmd_list(cfg); }
-    if(cmd=="info"){ if(argc<3) { cerr<<"specify package\n"; return 1;} return cmd_info(argv[2], cfg); }
+    vector<string> rest(a.begin()+1, a.end());
+    if(cmd!="verify" && cmd!="owner") prepare_dirs(cfg);
+    if(cmd=="sync"){ return cmd_sync(cfg, rest.empty()?"":rest[0]); }
+    if(cmd=="list"){ idb::View db; open_installed(cfg, db); return cmd_list(recipe_index(cfg), db, cout); }
+    if(cmd=="info"){ if(rest.empty()) { cerr<<"specify package\n"; return 1;} idb::View db; open_installed(cfg, db); return cmd_info(rest[0], recipe_index(cfg), db, cout, cerr); }
+    if(cmd=="owner"){ if(rest.empty()) { cerr<<"specify path\n"; return 1;} idb::View db; open_installed(cfg, db); return cmd_owner(rest, db, cout, cerr); }
+    if(cmd=="db"){ return cmd_db(rest.size()>0?rest[0]:"", rest.size()>1?rest[1]:"", cfg); }
     if(cmd=="plan"){ // generate pending.plan for targets
-        vector<string> targets; for(int i=2;i<argc;i++) targets.push_back(argv[i]); if(targets.empty()){ cerr<<"specify targets\n"; return 1; }
-        auto recs = find_recipes(cfg.recipes_dir); unordered_map<string, vector<string>> deps; for(auto &t: targets){ if(!recs.count(t)) { cerr<<"recipe "<<t<<" not found\n"; return 1; } Recipe r = load_recipe_toml(recs[t]); // simple: include only the requested pkgs and their deps recursively
-            queue<string> q; q.push(t); unordered_set<string> seen;
-            while(!q.empty()){ auto u=q.front(); q.pop(); if(seen.count(u)) continue; seen.insert(u); if(!recs.count(u)) continue; Recipe rr = load_recipe_toml(recs[u]); deps[rr.name]=rr.depends; for(auto &d: rr.depends) q.push(d); }
-        vector<string> order = topo_sort(deps);
+        if(rest.empty()){ cerr<<"specify targets\n"; return 1; } vector<string> order; if(plan_targets(recipe_index(cfg), rest, order)!=0) return 1;
         string planfile = joinp(cfg.state_dir, "pending.plan"); string pl; for(auto &o: order) pl += o+"\n"; dump(planfile, pl); cout<<"plan saved to "<<planfile<<"\n"; return 0; }
-    if(cmd=="build"){ // read pending.plan
-        string planfile = joinp(cfg.state_dir, "pending.plan"); if(!exists_file(planfile)){ cerr<<"no plan. run plan first\n"; return 1; }
-        vector<string> order; { string s=slurp(planfile); stringstream ss(s); string l; while(getline(ss,l)){ if(trim(l).empty()) continue; order.push_back(trim(l)); } }
-        auto recs = find_recipes(cfg.recipes_dir); auto db = load_installed(cfg);
-        bool do_strip=false; bool do_pack=true;
-        for(int i=2;i<argc;i++){ if(string(argv[i])=="--strip") do_strip=true; if(string(argv[i])=="--no-pack") do_pack=false; }
-        for(auto &n: order){ if(!recs.count(n)){ cerr<<"recipe "<<n<<" not found\n"; return 1; } Recipe r = load_recipe_toml(recs[n]); int rc = build_one(r,cfg,db,cfg.stage_dir,do_strip,do_pack); if(rc!=0){ cerr<<"build failed for "<<n<<" rc="<<rc<<"\n"; return rc; } }
-        cout<<ansi::green()<<"builds completed\n"<<ansi::reset(); return 0; }
+    if(cmd=="fetch"){ // prefetch every source of pending.plan
+        vector<string> order; if(!read_plan(cfg, order)) return 1;
+        for(size_t i=0;i<rest.size();i++) if(rest[i]=="--jobs" && i+1<rest.size()) cfg.fetch_jobs=max(1, atoi(rest[++i].c_str()));
+        auto &recs = recipe_index(cfg).recipes; vector<const Recipe*> rs; for(auto &l: order){ if(!recs.count(l)){ cerr<<"recipe "<<l<<" not found\n"; return 1; } rs.push_back(&recs.at(l)); }
+        return prefetch(cfg, rs, cfg.fetch_jobs); }
+    if(cmd=="build"){ vector<string> order; if(!read_plan(cfg, order)) return 1; return build_order(cfg, order, rest); } // read pending.plan
     if(cmd=="apply"){ return apply_stage(cfg); }
-    if(cmd=="install"){ if(argc<3){ cerr<<"specify package\n"; return 1; } string pkg = argv[2]; // plan+build+apply
-        auto recs = find_recipes(cfg.recipes_dir); if(!recs.count(pkg)){ cerr<<"recipe not found\n"; return 1; } // plan deps
-        vector<string> targets={pkg}; // reuse plan logic
-        run((string)"lfsd plan "+pkg); run((string)"lfsd build"); run((string)"lfsd apply"); return 0; }
-    if(cmd=="remove"){ if(argc<2){ cerr<<"specify package\n"; return 1; } string pkg = argv[2]; return remove_package(pkg,cfg); }
-    if(cmd=="snapshot"){ string lbl = argc>2?argv[2]:string("manual-")+nowstamp(); ensure_dir(joinp(cfg.cache_dir,"snaps")); string out = joinp(joinp(cfg.cache_dir,"snaps"), lbl+".tar.zst"); run("tar -C / -I zstd -cpf '"+out+"' usr"); cout<<"snapshot "<<out<<" created\n"; return 0; }
-    if(cmd=="rollback"){ if(argc<2){ cerr<<"specify snapshot name\n"; return 1; } string name=argv[2]; string path = joinp(joinp(cfg.cache_dir,"snaps"), name); if(!exists_file(path)) { cerr<<"snap not found\n"; return 1; } run("tar -C / -I zstd -xpf '"+path+"'"); cout<<"rollback applied\n"; return 0; }
+    if(cmd=="verify"){ vector<string> pkgs; bool full=false; for(auto &x: rest){ if(x=="--full") full=true; else pkgs.push_back(x); } return cmd_verify(cfg, pkgs, full); }
+    if(cmd=="install"){ if(rest.empty()){ cerr<<"specify package\n"; return 1; } // plan+build+apply in one go; pending.plan is left alone
+        vector<string> targets, flags; for(auto &x: rest) (x.rfind("--",0)==0 ? flags : targets).push_back(x);
+        vector<string> order; if(plan_targets(recipe_index(cfg), targets, order)!=0) return 1;
+        int rc = build_order(cfg, order, flags); if(rc!=0) return rc; return apply_stage(cfg); }
+    if(cmd=="remove"){ if(rest.empty()){ cerr<<"specify package\n"; return 1; } return remove_package(rest[0],cfg); }
+    if(cmd=="snapshot"){ string sub = rest.empty()?"":rest[0];
+        if(sub=="list") return snapshot_list(cfg);
+        if(sub=="gc"){ int keep=cfg.snapshot_keep, days=0; for(size_t i=1;i+1<rest.size();i++){ if(rest[i]=="--keep") keep=max(0, atoi(rest[++i].c_str())); else if(rest[i]=="--keep-days") days=max(0, atoi(rest[++i].c_str())); } return snapshot_gc(cfg, keep, days); }
+        if(sub=="export"){ if(rest.size()<2){ cerr<<"uso: lfsd snapshot export <name> [out.tar.zst]\n"; return 1; } return snapshot_export(cfg, rest[1], rest.size()>2?rest[2]:joinp(snap::dir(cfg), rest[1]+".tar.zst")); }
+        string lbl = string("manual-")+nowstamp(); vector<string> roots; // lfsd snapshot [label] [--path DIR]...
+        for(size_t i=0;i<rest.size();i++){ if(rest[i]=="--path" && i+1<rest.size()) roots.push_back(rest[++i]); else lbl=rest[i]; }
+        return cmd_snapshot(cfg, lbl, roots); }
+    if(cmd=="txn"){ if(!rest.empty() && rest[0]=="gc"){ int keep=cfg.txn_keep; for(size_t i=1;i+1<rest.size();i++) if(rest[i]=="--keep") keep=max(0, atoi(rest[++i].c_str())); return txn_gc(cfg, keep, true); }
+        cerr<<"uso: lfsd txn gc [--keep N]\n"; return 1; }
+    if(cmd=="rollback") return cmd_rollback(cfg, rest.empty()?"":rest[0], vector<string>(rest.begin()+min<size_t>(rest.size(),1), rest.end()));
     if(cmd=="upgrade") return cmd_upgrade(cfg);
-    if(cmd=="rebuild") { if(argc<2){ cerr<<"specify pkg\n"; return 1; } return cmd_rebuild(argv[2], cfg); }
-    if(cmd=="rebuild-all") return cmd_rebuild_all(cfg);
-    if(cmd=="install-bin"){ if(argc<3){ cerr<<"specify package tar.zst\n"; return 1; } string path=argv[2]; if(!exists_file(path)){ cerr<<"file not found\n"; return 1; } run("tar -C / -I zstd -xpf '"+path+"'"); return 0; }
+    if(cmd=="rebuild") { if(rest.empty()){ cerr<<"specify pkg\n"; return 1; } return cmd_rebuild(rest[0], cfg); }
+    if(cmd=="rebuild-all") return cmd_rebuild_all(cfg, !rest.empty() && rest[0]=="--force");
+    if(cmd=="cache") return cmd_cache(cfg, rest);
+    if(cmd=="install-bin"){ if(rest.empty()){ cerr<<"specify package tar.zst\n"; return 1; } string path=rest[0]; if(!exists_file(path)){ cerr<<"file not found\n"; return 1; } return run("tar -C / -I zstd -xpf '"+path+"'")?1:0; }
 
     cerr<<"unknown command"<<"\n"; return 1; }
+
+static string json_str(const string &v){ string o = "\""; for(unsigned char ch: v){ if(ch=='"' || ch=='\\') { o += '\\'; o += ch; } else if(ch<0x20){ char b[8]; snprintf(b, sizeof(b), "\\u%04x", ch); o += b; } else o += ch; } return o+"\""; }
+
+static void trace_save(const Config &c, const string &cmd){ vector<trace::Event> ev; { lock_guard<mutex> g(trace::mu); ev = trace::events; }
+    if(ev.empty() || c.trace_format=="off") return; sort(ev.begin(), ev.end(), [](auto &a, auto &b){ return a.start<b.start; });
+    string dir = joinp(c.log_dir, "trace"); ensure_dir(dir); string out; char b[128];
+    if(c.trace_format=="chrome"){ map<string,int> tid; for(auto &e: ev) tid.emplace(e.pkg, (int)tid.size()+1); // one row per package
+        out = "{\"traceEvents\":[\n"; for(auto &kv: tid){ snprintf(b, sizeof(b), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", kv.second); out += b+json_str(kv.first)+"}},\n"; }
+        for(size_t i=0;i<ev.size();i++){ auto &e = ev[i]; snprintf(b, sizeof(b), ",\"cat\":\"lfsd\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":1,\"tid\":%d,\"args\":{\"pkg\":", e.start*1e6, e.dur*1e6, tid[e.pkg]);
+            out += "{\"name\":"+json_str(e.phase)+b+json_str(e.pkg)+"}}"+(i+1<ev.size()?",\n":"\n"); }
+        out += "],\"displayTimeUnit\":\"ms\"}\n"; }
+    else { out = "{\"command\":"+json_str(cmd)+",\"started\":"+json_str(nowstamp())+",\"events\":[\n";
+        for(size_t i=0;i<ev.size();i++){ auto &e = ev[i]; snprintf(b, sizeof(b), ",\"start\":%.6f,\"duration\":%.6f}", e.start, e.dur); out += "  {\"pkg\":"+json_str(e.pkg)+",\"phase\":"+json_str(e.phase)+b+(i+1<ev.size()?",\n":"\n"); }
+        out += "]}\n"; }
+    string path = joinp(dir, nowstamp()+"-"+cmd+".json"); if(!dump_atomic(path, out)) errln(ansi::yellow()+"cannot write "+path+ansi::reset()); else errln(ansi::cyan()+"[trace] "+path+ansi::reset()); }
+
+// dispatch with a fresh trace, saved afterwards
+static int run_command(const Config &c, const vector<string> &a){ trace::reset(); int rc = dispatch(c, a); trace_save(c, a[0]); return rc; }
+
+// ----------------- daemon (unix socket, job queue) ----------------
+// Protocol: the client sends "<color>\0<cwd>\0<n>\0<env 1>\0...<env n>\0<cmd>\0<arg>\0..." and shuts down its write side; the reply is
+// frames <tag><len u32><bytes>: 'o' stdout, 'e' stderr, 'x' exit code (4 bytes), 'l' "run it locally".
+// Queries (list, info, owner, status) are answered at once from memory (when the client uses the same directories);
+// everything else goes to a queue run by a single worker, in the client's cwd and environment. A request matching a pending
+// or running job (same args, cwd, LFSD_*, PATH and build variables) just joins it: it gets the kept output and the same exit code.
+namespace daemon_ns {
+// out: the last frames of output (at most REPLAY_MAX bytes), replayed to clients that join late; cut = older output was dropped
+struct Job { vector<string> args, env; string key, cwd, match; bool color=false; vector<int> clients; deque<string> out; size_t out_bytes=0; bool cut=false; double queued=0; };
+static const size_t REPLAY_MAX = 256<<10;
+
+static bool send_all(int fd, const char *p, size_t n){ while(n){ ssize_t k = send(fd, p, n, MSG_NOSIGNAL); if(k<0){ if(errno==EINTR) continue; return false; } p+=k; n-=k; } return true; }
+static string frame(char tag, const string &data){ string f(1, tag); uint32_t n = data.size(); f.append((const char*)&n, 4); return f+data; }
+static string exit_frame(int rc){ int32_t v = rc; return frame('x', string((const char*)&v, 4)); }
+
+static mutex mu; static condition_variable cv; static deque<shared_ptr<Job>> queue; static shared_ptr<Job> running;
+static const int MAX_SERVING = 32; static atomic<int> serving{0}; // connections still sending their request or waiting for a query
+// queries read idx/db (the daemon's own directories only: a job for other directories swaps the global recipe index)
+static shared_ptr<idb::View> db; static shared_ptr<const RecipeIndex> idx; static int log_fd = -1; static chrono::steady_clock::time_point t0;
+static void dlog(const string &s){ string l = "[daemon] "+s+"\n"; if(write(log_fd, l.data(), l.size())<0){} }
+
+// (inode, mtime, size) of installed.db/recipes.idx as last loaded: a write by another process (LFSD_NO_DAEMON, lfsd-early) changes it
+struct Stamp { ino_t ino=0; long long mtime=-1; off_t size=-1; bool operator!=(const Stamp &o) const { return ino!=o.ino || mtime!=o.mtime || size!=o.size; } };
+static Stamp db_stamp, idx_stamp;
+static Stamp stamp(const string &p){ Stamp s; struct stat st; if(stat(p.c_str(), &st)==0){ s.ino=st.st_ino; s.mtime=ridx::mtime_ns(st); s.size=st.st_size; } return s; }
+
+static shared_ptr<idb::View> current_db(){ lock_guard<mutex> g(mu); return db; }
+static shared_ptr<const RecipeIndex> current_idx(){ lock_guard<mutex> g(mu); return idx; }
+static void reload_db(const Config &c){ Stamp s = stamp(installed_db_path(c)); auto v = make_shared<idb::View>(); open_installed(c, *v); lock_guard<mutex> g(mu); db = v; db_stamp = s; }
+static void set_idx(shared_ptr<const RecipeIndex> i, const Stamp &s){ lock_guard<mutex> g(mu); idx = move(i); idx_stamp = s; }
+
+// before a query: reload whatever another process rewrote since (two stats when nothing changed)
+static void refresh(const Config &c){ string ip = joinp(c.state_dir, "recipes.idx"); Stamp ds = stamp(installed_db_path(c)), is = stamp(ip); bool dbc, idxc;
+    { lock_guard<mutex> g(mu); dbc = ds!=db_stamp; idxc = is!=idx_stamp; }
+    if(dbc) reload_db(c);
+    if(idxc){ ridx::Data d; if(ridx::load(ip, d) && ridx::fresh(d, c.jobs)) set_idx(index_from(d), is); } } // stale: left to the next job, which rewrites it
+
+// output of the running job goes to its clients (and is kept for clients that join later)
+static void broadcast(Job &j, const string &f){ lock_guard<mutex> g(mu); j.out.push_back(f); j.out_bytes += f.size();
+    while(j.out_bytes>REPLAY_MAX && j.out.size()>1){ j.out_bytes -= j.out.front().size(); j.out.pop_front(); j.cut = true; } for(auto it=j.clients.begin(); it!=j.clients.end();){ if(!send_all(*it, f.data(), f.size())){ close(*it); it = j.clients.erase(it); } else ++it; } }
+static void pump(int fd, char tag, Job *j){ char buf[65536]; ssize_t n; while((n = read(fd, buf, sizeof(buf)))!=0){ if(n<0){ if(errno==EINTR) continue; break; } broadcast(*j, frame(tag, string(buf, n))); } close(fd); }
+
+static void set_env(const vector<string> &env){ clearenv(); for(auto &e: env){ size_t eq = e.find('='); if(eq!=string::npos && eq) setenv(e.substr(0, eq).c_str(), e.c_str()+eq+1, 1); } }
+static vector<string> get_env(){ vector<string> out; for(char **e = environ; e && *e; e++) out.push_back(*e); return out; }
+
+static void worker(const Config &c){ const vector<string> denv = get_env();
+    while(true){ shared_ptr<Job> j; { unique_lock<mutex> lk(mu); cv.wait(lk, []{ return !queue.empty(); }); j = queue.front(); queue.pop_front(); running = j; }
+        dlog("start: "+j->key); double st = secs_since(t0);
+        // stdout/stderr (and every child the job forks) go to pipes read by the pumps
+        int po[2], pe[2]; if(pipe2(po, O_CLOEXEC)!=0 || pipe2(pe, O_CLOEXEC)!=0){ dlog("pipe failed"); abort(); }
+        cout.flush(); cerr.flush(); fflush(nullptr); int so = dup(1), se = dup(2); dup2(po[1], 1); dup2(pe[1], 2); close(po[1]); close(pe[1]);
+        thread to(pump, po[0], 'o', j.get()), te(pump, pe[0], 'e', j.get());
+        ansi::enabled = j->color; int rc;
+        // the client's environment (LFSD_*, CFLAGS, ...) and cwd, as if it had run the command itself; only this thread reads them
+        set_env(j->env); Config jc = load_config(); bool same_dirs = jc.recipes_dir==c.recipes_dir && jc.state_dir==c.state_dir;
+        try { if(chdir(j->cwd.c_str())!=0){ cerr<<ansi::red()<<"cannot enter "<<j->cwd<<": "<<strerror(errno)<<ansi::reset()<<"\n"; rc = 1; } else { recipe_index_ptr(jc, true); rc = run_command(jc, j->args); } }
+        catch(const exception &e){ cerr<<ansi::red()<<"internal error: "<<e.what()<<ansi::reset()<<"\n"; rc = 1; }
+        cout.flush(); cerr.flush(); fflush(nullptr); dup2(so, 1); dup2(se, 2); close(so); close(se); to.join(); te.join();
+        set_env(denv); if(chdir("/")!=0){}
+        if(same_dirs){ Stamp s = stamp(joinp(c.state_dir, "recipes.idx")); set_idx(recipe_index_ptr(c), s); } // revalidated by the job (and by sync)
+        reload_db(c);
+        { lock_guard<mutex> g(mu); string f = exit_frame(rc); for(int fd: j->clients){ send_all(fd, f.data(), f.size()); close(fd); } j->clients.clear(); running.reset(); }
+        char dur[32]; snprintf(dur, sizeof(dur), "%.1fs", secs_since(t0)-st); dlog("done: "+j->key+" rc="+to_string(rc)+" ("+dur+")"); }
+}
+
+static int query(const Config &c, const vector<string> &a, ostream &out, ostream &err){
+    if(a[0]=="status"){ lock_guard<mutex> g(mu); if(running) out<<"running: "<<running->key<<" ("<<running->clients.size()<<" clients)\n"; for(auto &j: queue) out<<"queued:  "<<j->key<<" ("<<j->clients.size()<<" clients)\n"; if(!running && queue.empty()) out<<"idle\n"; return 0; }
+    refresh(c); auto ix = current_idx(); auto v = current_db();
+    if(a[0]=="list") return cmd_list(*ix, *v, out);
+    if(a[0]=="info"){ if(a.size()<2){ err<<"specify package\n"; return 1; } return cmd_info(a[1], *ix, *v, out, err); }
+    if(a.size()<2){ err<<"specify path\n"; return 1; } return cmd_owner(vector<string>(a.begin()+1, a.end()), *v, out, err); } // paths already absolute
+
+static void serve(const Config &c, int fd){ string req; char buf[4096]; ssize_t n;
+    struct timeval rt{10, 0}; setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rt, sizeof(rt)); // a client that never finishes its request is dropped
+    while((n = read(fd, buf, sizeof(buf)))!=0){ if(n<0){ if(errno==EINTR) continue; close(fd); return; } req.append(buf, n); if(req.size()>(1<<20)){ close(fd); return; } }
+    struct timeval tv{30, 0}; setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)); // a stuck client is dropped instead of stalling the job output
+    vector<string> a; size_t p=0, q; while((q = req.find('\0', p))!=string::npos){ a.push_back(req.substr(p, q-p)); p=q+1; }
+    if(a.size()<4){ close(fd); return; } bool color = a[0]=="1"; string cwd = a[1]; size_t ne = strtoul(a[2].c_str(), nullptr, 10); if(a.size()<4+ne || cwd.empty() || cwd[0]!='/'){ close(fd); return; }
+    vector<string> env(a.begin()+3, a.begin()+3+ne); a.erase(a.begin(), a.begin()+3+ne);
+    if(a[0]=="list" || a[0]=="info" || a[0]=="owner" || a[0]=="status"){
+        // the in-memory index/db only answer for the daemon's own directories; otherwise the client runs the query itself
+        auto env_or = [&](const string &k, const string &def){ for(auto &e: env) if(e.compare(0, k.size()+1, k+"=")==0) return e.substr(k.size()+1); return def; };
+        if(a[0]!="status" && (env_or("LFSD_RECIPES_DIR", Config().recipes_dir)!=c.recipes_dir || env_or("LFSD_STATE_DIR", Config().state_dir)!=c.state_dir)){ string f = frame('l', ""); send_all(fd, f.data(), f.size()); close(fd); return; }
+        if(a[0]=="owner") for(size_t i=1;i<a.size();i++) if(!a[i].empty() && a[i][0]!='/') a[i] = (filesystem::path(cwd)/a[i]).lexically_normal().string(); // relative to the client's cwd
+        ostringstream out, err; int rc; { static mutex qmu; lock_guard<mutex> g(qmu); bool was = ansi::enabled; ansi::enabled = color; rc = query(c, a, out, err); ansi::enabled = was; }
+        string f = frame('o', out.str())+frame('e', err.str())+exit_frame(rc); send_all(fd, f.data(), f.size()); close(fd); return; }
+    struct ucred cr; socklen_t cl = sizeof(cr); if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &cl)!=0 || cr.uid!=0){ string f = frame('e', "permission denied: only root may queue "+a[0]+"\n")+exit_frame(1); send_all(fd, f.data(), f.size()); close(fd); return; }
+    string key; for(auto &x: a) key += (key.empty()?"":" ")+x; string match = key+'\0'+cwd;
+    for(auto &e: env) if(e.compare(0, 5, "LFSD_")==0 || e.compare(0, 5, "PATH=")==0 || build_env_var(e)) match += '\0'+e; // not SHLVL, TERM, ...: same command from two shells still merges
+    lock_guard<mutex> g(mu); shared_ptr<Job> same; if(running && running->match==match) same = running; for(auto &j: queue) if(j->match==match) same = j;
+    if(same){ string f = frame('e', "[daemon] joining "+string(same==running?"running":"queued")+" job: "+key+"\n"+(same->cut?"[daemon] earlier output omitted\n":""));
+        for(auto &o: same->out) f += o; if(send_all(fd, f.data(), f.size())) same->clients.push_back(fd); else close(fd); return; }
+    auto j = make_shared<Job>(); j->args = a; j->key = key; j->match = match; j->cwd = cwd; j->env = env; j->color = color; j->clients.push_back(fd); j->queued = secs_since(t0);
+    if(running || !queue.empty()){ string f = frame('e', "[daemon] queued behind "+to_string(queue.size()+(running?1:0))+" job(s)\n"); send_all(fd, f.data(), f.size()); }
+    queue.push_back(j); cv.notify_one(); }
+}
+
+static int cmd_daemon(const Config &c){ using namespace daemon_ns; signal(SIGPIPE, SIG_IGN); t0 = chrono::steady_clock::now(); log_fd = dup(2); prepare_dirs(c);
+    { auto i = recipe_index_ptr(c); set_idx(i, stamp(joinp(c.state_dir, "recipes.idx"))); } reload_db(c);
+    int s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0); struct sockaddr_un addr{}; addr.sun_family = AF_UNIX;
+    if(s<0 || c.socket_path.size()>=sizeof(addr.sun_path)){ cerr<<"invalid socket "<<c.socket_path<<"\n"; return 1; }
+    strcpy(addr.sun_path, c.socket_path.c_str()); ensure_dir(filesystem::path(c.socket_path).parent_path()); unlink(c.socket_path.c_str());
+    if(::bind(s, (struct sockaddr*)&addr, sizeof(addr))!=0 || chmod(c.socket_path.c_str(), 0666)!=0 || listen(s, 64)!=0){ cerr<<ansi::red()<<"cannot listen on "<<c.socket_path<<": "<<strerror(errno)<<ansi::reset()<<"\n"; return 1; }
+    dlog("listening on "+c.socket_path+" ("+to_string(current_idx()->recipes.size())+" recipes, "+to_string(current_db()->npkgs())+" installed)");
+    thread(worker, cref(c)).detach();
+    while(true){ int fd = accept4(s, nullptr, nullptr, SOCK_CLOEXEC); if(fd<0){ if(errno==EINTR || errno==ECONNABORTED) continue; dlog(string("accept: ")+strerror(errno)); return 1; }
+        // the socket is world-writable: cap the request threads so idle connections cannot pile up
+        if(serving>=MAX_SERVING){ string f = frame('e', "[daemon] too many connections\n")+exit_frame(1); send_all(fd, f.data(), f.size()); close(fd); continue; }
+        serving++; thread([&c, fd]{ serve(c, fd); serving--; }).detach(); }
+}
+
+// thin client: returns -1 when no daemon is listening (the caller then runs the command itself)
+static int daemon_client(const Config &c, const vector<string> &a){ if(getenv("LFSD_NO_DAEMON")) return -1;
+    int s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0); struct sockaddr_un addr{}; addr.sun_family = AF_UNIX; if(s<0 || c.socket_path.size()>=sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, c.socket_path.c_str()); if(connect(s, (struct sockaddr*)&addr, sizeof(addr))!=0){ close(s); return -1; }
+    error_code ec; string cwd = filesystem::current_path(ec).string(); if(ec){ close(s); return -1; } auto env = daemon_ns::get_env();
+    string req = ansi::enabled?"1":"0"; req += '\0'; req += cwd+'\0'+to_string(env.size())+'\0'; for(auto &e: env) req += e+'\0'; for(auto &x: a) req += x+'\0'; // paths are resolved by the daemon against cwd
+    if(!daemon_ns::send_all(s, req.data(), req.size())){ close(s); return -1; } shutdown(s, SHUT_WR);
+    string in; char buf[65536]; ssize_t n; int rc = -2;
+    while(rc==-2 && (n = read(s, buf, sizeof(buf)))!=0){ if(n<0){ if(errno==EINTR) continue; break; } in.append(buf, n); size_t p=0;
+        while(in.size()-p>=5){ uint32_t len; memcpy(&len, in.data()+p+1, 4); if(in.size()-p-5<len) break; char tag = in[p]; const char *d = in.data()+p+5;
+            if(tag=='l'){ close(s); return -1; } // not served from memory: run here
+            if(tag=='x' && len==4){ int32_t v; memcpy(&v, d, 4); rc = v; } else if(len && write(tag=='o'?1:2, d, len)<0){} p += 5+len; }
+        in.erase(0, p); }
+    close(s); if(rc==-2){ cerr<<ansi::red()<<"lost connection to lfsd daemon"<<ansi::reset()<<"\n"; return 1; } return rc; }
+
+// ----------------- main CLI ----------------
+int main(int argc, char** argv){ ios::sync_with_stdio(false); cin.tie(nullptr);
+    Config cfg = load_config(); ansi::init(cfg.color);
+    if(argc<2){ cerr<<"uso: lfsd <cmd> [args]\n"; return 1; }
+    vector<string> a(argv+1, argv+argc);
+    if(a[0]=="daemon") return cmd_daemon(cfg);
+    int rc = daemon_client(cfg, a); if(rc!=-1) return rc; // no daemon: run here
+    if(a[0]=="status"){ cout<<"no daemon listening on "<<cfg.socket_path<<"\n"; return 0; }
+    return run_command(cfg, a); }
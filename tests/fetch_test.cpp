@@ -0,0 +1,64 @@
+// lfsd-fetch-test: download resume (partial/) and incremental git fetch, against a local HTTP server and a local git repo.
+// Usage: lfsd-fetch-test [--dir DIR]   (run by ctest; exits 77 = skipped when curl or git is missing)
+#define main lfsd_main
+#include "../lfsd.cpp"
+#undef main
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+static int failures = 0;
+static void check(bool ok, const string &what){ printf("%s %s\n", ok?"ok  ":"FAIL", what.c_str()); if(!ok) failures++; }
+
+// one connection at a time; honours "Range: bytes=N-" (206) and records what was asked and sent
+namespace httpd {
+    static string body; static atomic<long long> range_start{-1}, sent{0}; static atomic<int> requests{0};
+    static void serve(int ls){ while(true){ int fd = accept(ls, nullptr, nullptr); if(fd<0){ if(errno==EINTR) continue; return; }
+        string req; char buf[4096]; ssize_t n; while(req.find("\r\n\r\n")==string::npos && (n = read(fd, buf, sizeof(buf)))>0) req.append(buf, n);
+        string low = req; transform(low.begin(), low.end(), low.begin(), [](unsigned char ch){ return tolower(ch); });
+        long long from = 0; size_t r = low.find("\r\nrange: bytes="); if(r!=string::npos) from = atoll(low.c_str()+r+15);
+        requests++; range_start = r==string::npos ? -1 : from;
+        string out; if(from>=(long long)body.size()) out = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */"+to_string(body.size())+"\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        else { string part = body.substr(from); out = string(r==string::npos?"HTTP/1.1 200 OK\r\n":"HTTP/1.1 206 Partial Content\r\nContent-Range: bytes "+to_string(from)+"-"+to_string(body.size()-1)+"/"+to_string(body.size())+"\r\n")
+            +"Content-Length: "+to_string(part.size())+"\r\nConnection: close\r\n\r\n"+part; sent += part.size(); }
+        for(size_t off=0; off<out.size();){ ssize_t k = write(fd, out.data()+off, out.size()-off); if(k<0 && errno==EINTR) continue; if(k<=0) break; off+=k; } close(fd); } }
+    static int start(){ int ls = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0); struct sockaddr_in a{}; a.sin_family = AF_INET; a.sin_addr.s_addr = htonl(INADDR_LOOPBACK); socklen_t al = sizeof(a);
+        if(ls<0 || ::bind(ls, (struct sockaddr*)&a, sizeof(a))!=0 || listen(ls, 8)!=0 || getsockname(ls, (struct sockaddr*)&a, &al)!=0) return -1;
+        thread(serve, ls).detach(); return ntohs(a.sin_port); }
+}
+
+// a truncated partial/<sha256(url)> is continued with a ranged request instead of downloaded again
+static void test_resume(const Config &c){ string blob; mt19937 rng(7); for(int i=0;i<1<<20;i++) blob += char('a'+rng()%26); httpd::body = blob;
+    int port = httpd::start(); if(port<0){ check(false, "resume: local http server"); return; }
+    string url = "http://127.0.0.1:"+to_string(port)+"/src-1.0.tar.gz"; sha256::Ctx x; sha256::update(x, blob.data(), blob.size()); string sha = sha256::final_hex(x);
+    size_t have = blob.size()/3; string partial = joinp(c.sources_dir, "partial"); ensure_dir(partial); dump(joinp(partial, hex_of(url)), blob.substr(0, have));
+    string got = fetch_source(c, url, sha);
+    check(!got.empty() && slurp(got)==blob, "resume: cached file matches the served one");
+    check(httpd::range_start==(long long)have, "resume: request continued at byte "+to_string(have)+" (got "+to_string(httpd::range_start.load())+")");
+    check(httpd::sent==(long long)(blob.size()-have), "resume: only the missing "+to_string(blob.size()-have)+" bytes were sent (sent "+to_string(httpd::sent.load())+")");
+    check(!exists_file(joinp(partial, hex_of(url))), "resume: partial file moved into by-sha256");
+    int before = httpd::requests; check(fetch_source(c, url, sha)==got && httpd::requests==before, "resume: second fetch is a cache hit"); }
+
+// prefetch on an empty sources_dir takes the per-repo lock, then fetches into the existing checkout instead of re-cloning it
+static void test_git_incremental(const Config &c, const string &dir){ string repo = joinp(dir, "upstream"), url = "file://"+repo;
+    auto git = [&](const string &args){ return run("git -C '"+repo+"' -c user.name=t -c user.email=t@t "+args+" >/dev/null 2>&1"); };
+    ensure_dir(repo); dump(joinp(repo, "one"), "1\n");
+    if(git("init -q")!=0 || git("add one")!=0 || git("commit -q -m one")!=0){ check(false, "git: create upstream repo"); return; }
+    Recipe r; r.name = "gitpkg"; r.version = "1"; r.git = url; string co = git_cache_dir(c, url);
+    check(prefetch(c, {&r}, 1)==0 && slurp(joinp(co, "one"))=="1\n", "git: first prefetch clones");
+    check(exists_file(co+".lock"), "git: lock file was created (sources_dir/git existed before flock)");
+    string marker = joinp(co, ".git/lfsd-test-marker"); dump(marker, "x");
+    dump(joinp(repo, "two"), "2\n"); if(git("add two")!=0 || git("commit -q -m two")!=0){ check(false, "git: second upstream commit"); return; }
+    dump(joinp(co, "junk"), "left over\n");
+    check(prefetch(c, {&r}, 1)==0 && slurp(joinp(co, "two"))=="2\n", "git: second prefetch sees the new commit");
+    check(exists_file(marker), "git: existing checkout was fetched into, not re-cloned");
+    check(!exists_file(joinp(co, "junk")), "git: untracked files are cleaned"); }
+
+int main(int argc, char **argv){ string dir = "/tmp/lfsd-fetch-test";
+    for(int i=1;i<argc;i++){ string a = argv[i]; if(a=="--dir" && i+1<argc) dir = argv[++i]; }
+    if(run("command -v curl >/dev/null && command -v git >/dev/null")!=0){ printf("skip: curl and git are required\n"); return 77; }
+    signal(SIGPIPE, SIG_IGN); ansi::init("never"); error_code ec; filesystem::remove_all(dir, ec);
+    Config c; c.jobs = 2; c.trace_format = "off"; c.sources_dir = joinp(dir, "sources"); c.log_dir = joinp(dir, "log"); // sources_dir is not created: prefetch must cope
+    test_resume(c); filesystem::remove_all(c.sources_dir, ec);
+    test_git_incremental(c, dir);
+    if(!failures) filesystem::remove_all(dir, ec);
+    printf("%s\n", failures?"FAILED":"all passed"); return failures?1:0; }
@@ -0,0 +1,34 @@
+// lfsd-stage-test: package_stage() manifests match the stripped stage (hardlinked aliases too); artifacts keep large uid/gid.
+// Usage: lfsd-stage-test [--dir DIR]   (run by ctest; exits 77 = skipped when strip or zstd is missing)
+#define main lfsd_main
+#include "../lfsd.cpp"
+#undef main
+
+static int failures = 0;
+static void check(bool ok, const string &what){ printf("%s %s\n", ok?"ok  ":"FAIL", what.c_str()); if(!ok) failures++; }
+
+// an unstripped ELF with a hardlinked alias (the perl / perl5.x layout); every manifest entry must describe the file on disk
+static void test_strip_hardlink(const string &dir, const string &artifact){ error_code ec; string root = joinp(dir, "stage"); filesystem::remove_all(root, ec); ensure_dir(joinp(root, "usr/bin"));
+    string exe = joinp(root, "usr/bin/perl5.38"), alias = joinp(root, "usr/bin/perl"); string what = artifact.empty()?"manifest: ":"pack: ";
+    filesystem::copy_file("/proc/self/exe", exe, ec); struct stat before; if(ec || stat(exe.c_str(), &before)!=0 || link(exe.c_str(), alias.c_str())!=0){ check(false, what+"create stage"); return; }
+    vector<ManifestEntry> mani; check(package_stage(root, artifact, true, 2, mani, "perl")==0, what+"package_stage succeeds");
+    struct stat after; stat(exe.c_str(), &after); check(after.st_size<before.st_size, what+"the ELF was stripped ("+to_string(before.st_size)+" -> "+to_string(after.st_size)+" bytes)");
+    check(mani.size()==2, what+"binary and alias listed (got "+to_string(mani.size())+" entries)");
+    for(auto &m: mani){ struct stat st; string p = joinp(root, m.path.substr(1)); if(lstat(p.c_str(), &st)!=0 || S_ISDIR(st.st_mode)) continue;
+        check(m.size==(long long)st.st_size && m.mtime==(long long)st.st_mtime, what+m.path+" size/mtime match the disk ("+to_string(m.size)+" vs "+to_string(st.st_size)+")");
+        check(m.sha256==installed_hash(p), what+m.path+" hash matches the disk"); } }
+
+// uid/gid above 07777777 do not fit the 8-byte ustar fields; they travel in pax records and come back intact
+static void test_big_ids(const string &dir){ error_code ec; string root = joinp(dir, "ids"), art = joinp(dir, "ids.tar.zst"); filesystem::remove_all(root, ec); ensure_dir(root);
+    string f = joinp(root, "owned"); dump(f, "x\n"); if(lchown(f.c_str(), 3000000, 4000000)!=0){ printf("skip: big ids need root\n"); return; }
+    vector<ManifestEntry> mani; check(package_stage(root, art, false, 1, mani, "ids")==0, "ids: package_stage succeeds");
+    string listing = trim(caprun("zstd -dc '"+art+"' | tar --numeric-owner -tvf - ./owned"));
+    check(listing.find("3000000/4000000")!=string::npos, "ids: tar lists uid/gid 3000000/4000000 ("+listing+")"); }
+
+int main(int argc, char **argv){ string dir = "/tmp/lfsd-stage-test";
+    for(int i=1;i<argc;i++){ string a = argv[i]; if(a=="--dir" && i+1<argc) dir = argv[++i]; }
+    if(run("command -v strip >/dev/null && command -v zstd >/dev/null")!=0){ printf("skip: strip and zstd are required\n"); return 77; }
+    ansi::init("never"); error_code ec; filesystem::remove_all(dir, ec); ensure_dir(dir);
+    test_strip_hardlink(dir, ""); test_strip_hardlink(dir, joinp(dir, "perl.tar.zst")); test_big_ids(dir);
+    if(!failures) filesystem::remove_all(dir, ec);
+    printf("%s\n", failures?"FAILED":"all passed"); return failures?1:0; }